@@ -0,0 +1,118 @@
+#ifndef MCTS_ARENA
+#define MCTS_ARENA
+
+#include "atomic_ops.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Handles are 32-bit indices into an Arena. Tree nodes and edges refer to each
+// other by handle rather than by pointer, which halves the size of every link
+// and keeps them valid however the arena grows.
+using Handle = uint32_t;
+constexpr Handle kNullHandle = UINT32_MAX;
+
+// Chunked vector of T. Elements are allocated in fixed-size chunks that are
+// never moved, so element addresses are stable and growth never copies, while
+// consecutive allocations still sit next to each other in memory. Elements are
+// only ever freed all at once, with clear().
+//
+// Adding a chunk may move the list of chunks, so an allocation that needs one
+// must not race with any other access. Once reserve() has made room for every
+// allocation, one thread may allocate while others read elements allocated
+// earlier, and several threads may call allocateShared at once.
+template <class T> class Arena {
+public:
+  static constexpr uint32_t kChunkBits = 12;
+  static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { clear(); }
+
+  // Constructs a new element in place and returns its handle.
+  template <class... Args> Handle allocate(Args &&...args) {
+    const uint32_t size = size_;
+    assert(size < kNullHandle);
+    if ((size >> kChunkBits) == chunks_.size()) {
+      addChunk();
+    }
+    new (slot(size)) T(std::forward<Args>(args)...);
+    atomicStore(size_, size + 1);
+    return size;
+  }
+
+  // Like allocate, but safe to call from several threads at once. Since it
+  // can't add chunks, it returns kNullHandle and allocates nothing once the
+  // chunks reserve() added are full.
+  template <class... Args> Handle allocateShared(Args &&...args) {
+    const uint32_t limit = std::min<size_t>(capacity(), kNullHandle);
+    uint32_t handle;
+    if (!atomicFetchAddUpTo(size_, 1u, limit, &handle)) {
+      return kNullHandle;
+    }
+    new (slot(handle)) T(std::forward<Args>(args)...);
+    return handle;
+  }
+
+  T &operator[](Handle handle) {
+    assert(handle < atomicLoad(size_));
+    return *std::launder(reinterpret_cast<T *>(slot(handle)));
+  }
+
+  const T &operator[](Handle handle) const {
+    assert(handle < atomicLoad(size_));
+    return *std::launder(reinterpret_cast<const T *>(
+        const_cast<Arena *>(this)->slot(handle)));
+  }
+
+  // Allocates the chunks needed to hold n elements up front.
+  void reserve(size_t n) {
+    while (chunks_.size() * kChunkSize < n) {
+      addChunk();
+    }
+  }
+
+  // Destroys every element at once. Chunks stay allocated for reuse.
+  void clear() {
+    for (uint32_t handle = 0; handle < size_; handle++) {
+      (*this)[handle].~T();
+    }
+    size_ = 0;
+  }
+
+  uint32_t size() const { return atomicLoad(size_); }
+
+  // Elements the arena holds without adding a chunk.
+  size_t capacity() const { return chunks_.size() * kChunkSize; }
+
+  // Exchanges the elements of the two arenas without moving any of them.
+  void swap(Arena &other) {
+    chunks_.swap(other.chunks_);
+    std::swap(size_, other.size_);
+  }
+
+private:
+  // Uninitialized storage for one element.
+  struct Slot {
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  // Left uninitialized, so memory is only touched as elements are allocated.
+  void addChunk() { chunks_.emplace_back(new Slot[kChunkSize]); }
+
+  unsigned char *slot(Handle handle) {
+    return chunks_[handle >> kChunkBits][handle & (kChunkSize - 1)].bytes;
+  }
+
+  std::vector<std::unique_ptr<Slot[]>> chunks_;
+  uint32_t size_ = 0;
+};
+
+#endif // MCTS_ARENA
@@ -0,0 +1,76 @@
+#ifndef MCTS_ATOMIC_OPS
+#define MCTS_ATOMIC_OPS
+
+#include <type_traits>
+
+// Atomic operations on ordinary variables, like C++20's std::atomic_ref.
+//
+// Search statistics are only updated concurrently during a parallel search.
+// The rest of the time, single-threaded code reads and writes the same fields
+// directly, and UCB selection loads them as plain arrays with SIMD
+// instructions. So the fields stay plain ints and doubles, and the parallel
+// searches go through these functions instead. Built on the GCC/Clang
+// __atomic builtins. Orders are __ATOMIC_RELAXED, __ATOMIC_ACQUIRE, etc.
+
+template <class T> T atomicLoad(const T &x, int order = __ATOMIC_RELAXED) {
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  T value;
+  __atomic_load(&x, &value, order);
+  return value;
+}
+
+template <class T>
+void atomicStore(T &x, T value, int order = __ATOMIC_RELAXED) {
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  __atomic_store(&x, &value, order);
+}
+
+// Replaces x with desired if it still holds expected. Otherwise loads the
+// current value into expected. Returns whether x was replaced.
+template <class T>
+bool atomicCompareExchange(T &x, T &expected, T desired,
+                           int order = __ATOMIC_ACQ_REL) {
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  const int failure_order =
+      order == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE
+      : order == __ATOMIC_RELEASE ? __ATOMIC_RELAXED
+                                  : order;
+  return __atomic_compare_exchange(&x, &expected, &desired, /*weak=*/false,
+                                   order, failure_order);
+}
+
+// Adds delta to x, returning the old value.
+template <class T> T atomicFetchAdd(T &x, T delta) {
+  if constexpr (std::is_integral<T>::value) {
+    return __atomic_fetch_add(&x, delta, __ATOMIC_RELAXED);
+  } else {
+    // No fetch_add for floating point, so retry a compare-exchange.
+    T expected = atomicLoad(x);
+    T desired;
+    do {
+      desired = expected + delta;
+    } while (!__atomic_compare_exchange(&x, &expected, &desired,
+                                        /*weak=*/true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+    return expected;
+  }
+}
+
+// Adds delta to x, unless that would take it past limit. Stores the old value
+// in *old and returns whether delta was added.
+template <class T> bool atomicFetchAddUpTo(T &x, T delta, T limit, T *old) {
+  static_assert(std::is_integral<T>::value, "");
+  T expected = atomicLoad(x);
+  do {
+    if (expected > limit || limit - expected < delta) {
+      *old = expected;
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&x, &expected, expected + delta,
+                                        /*weak=*/true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  *old = expected;
+  return true;
+}
+
+#endif // MCTS_ATOMIC_OPS
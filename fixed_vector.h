@@ -0,0 +1,77 @@
+#ifndef MCTS_FIXED_VECTOR
+#define MCTS_FIXED_VECTOR
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Vector with a capacity fixed at compile time and storage inline, so it never
+// touches the heap. Used for per-move scratch lists like the valid actions in
+// a state, where the maximum size is known up front.
+template <class T, int Capacity> class FixedVector {
+public:
+  FixedVector() = default;
+  FixedVector(const FixedVector &other) {
+    for (const T &el : other) {
+      push_back(el);
+    }
+  }
+  FixedVector &operator=(const FixedVector &other) {
+    if (this != &other) {
+      clear();
+      for (const T &el : other) {
+        push_back(el);
+      }
+    }
+    return *this;
+  }
+  ~FixedVector() { clear(); }
+
+  void push_back(const T &value) { emplace_back(value); }
+
+  template <class... Args> T &emplace_back(Args &&...args) {
+    assert(size_ < Capacity);
+    T *el = new (data() + size_) T(std::forward<Args>(args)...);
+    size_++;
+    return *el;
+  }
+
+  void clear() {
+    for (int i = 0; i < size_; i++) {
+      data()[i].~T();
+    }
+    size_ = 0;
+  }
+
+  T &operator[](int i) {
+    assert(i >= 0 && i < size_);
+    return data()[i];
+  }
+  const T &operator[](int i) const {
+    assert(i >= 0 && i < size_);
+    return data()[i];
+  }
+  T &at(int i) { return (*this)[i]; }
+  const T &at(int i) const { return (*this)[i]; }
+
+  T *begin() { return data(); }
+  T *end() { return data() + size_; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + size_; }
+
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  static constexpr int capacity() { return Capacity; }
+
+private:
+  T *data() { return std::launder(reinterpret_cast<T *>(storage_)); }
+  const T *data() const {
+    return std::launder(reinterpret_cast<const T *>(storage_));
+  }
+
+  alignas(T) unsigned char storage_[sizeof(T) * Capacity];
+  int size_ = 0;
+};
+
+#endif // MCTS_FIXED_VECTOR
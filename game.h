@@ -1,50 +1,176 @@
 #ifndef MCTS_GAME
 #define MCTS_GAME
 
-#include <map>
+#include "fixed_vector.h"
+#include "rng.h"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
 #include <vector>
 
-class RewardMap {
+// Reward for each of NumPlayers players, indexed by player number. Fixed size,
+// so copies are plain memcpys and adding two of them is a loop the compiler can
+// vectorize.
+template <int NumPlayers> class RewardMap {
 public:
-  RewardMap(const std::map<int, double> &data_) : data(data_) {}
+  constexpr RewardMap() : data{} {}
+  constexpr RewardMap(const std::array<double, NumPlayers> &data_)
+      : data(data_) {}
+
+  double &at(int turn) {
+    assert(turn >= 0 && turn < NumPlayers);
+    return data[turn];
+  }
+  const double &at(int turn) const {
+    assert(turn >= 0 && turn < NumPlayers);
+    return data[turn];
+  }
 
-  double &at(int turn);
-  const double &at(int turn) const;
-  RewardMap &operator+=(const RewardMap &rhs);
+  RewardMap &operator+=(const RewardMap &rhs) {
+    for (int i = 0; i < NumPlayers; i++) {
+      data[i] += rhs.data[i];
+    }
+    return *this;
+  }
 
-  std::string toString() const;
+  RewardMap &operator*=(double scale) {
+    for (int i = 0; i < NumPlayers; i++) {
+      data[i] *= scale;
+    }
+    return *this;
+  }
 
-  std::map<int, double> data;
+  std::string toString() const {
+    std::stringstream ss;
+    ss << std::endl;
+    for (int i = 0; i < NumPlayers; i++) {
+      ss << i << ": " << data[i] << std::endl;
+    }
+    ss << std::endl;
+    return ss.str();
+  }
+
+  std::array<double, NumPlayers> data;
 };
 
-RewardMap operator+(RewardMap lhs, const RewardMap &rhs);
+template <int NumPlayers>
+RewardMap<NumPlayers> operator+(RewardMap<NumPlayers> lhs,
+                                const RewardMap<NumPlayers> &rhs) {
+  // Player-wise add every element of rhs to lhs.
+  lhs += rhs;
+  return lhs;
+}
+
+constexpr RewardMap<2> TwoPlayerFirstPlayerWinsReward({1.0, -1.0});
+constexpr RewardMap<2> TwoPlayerSecondPlayerWinsReward({-1.0, 1.0});
+constexpr RewardMap<2> TwoPlayerNobodyWinsReward({0.0, 0.0});
 
-const RewardMap TwoPlayerFirstPlayerWinsReward =
-    RewardMap({{0, 1.0}, {1, -1.0}});
-const RewardMap TwoPlayerSecondPlayerWinsReward =
-    RewardMap({{0, -1.0}, {1, 1.0}});
-const RewardMap TwoPlayerNobodyWinsReward = RewardMap({{0, 0.0}, {1, 0.0}});
+// Maps a state to the 64-bit key used by the hashed node stores in MCTS and
+// UCT. Defaults to std::hash<State>; games that keep a hash up to date as moves
+// are played (e.g. Zobrist hashing) should specialize this to return it.
+template <class State> struct StateHash {
+  uint64_t operator()(const State &state) const {
+    return std::hash<State>()(state);
+  }
+};
+
+// Compile-time facts about a game, looked up by its state and action types.
+// Every game specializes this with:
+//   static constexpr int kNumPlayers: number of players, numbered from 0.
+//   static constexpr int kMaxActions: most valid actions in any one state.
+template <class State, class Action> struct GameTraits;
 
 // Game should tell you all valid moves at any state.
 template <class State, class Action> class Game {
 public:
+  static constexpr int kNumPlayers = GameTraits<State, Action>::kNumPlayers;
+  // Reward for each player.
+  using Reward = RewardMap<kNumPlayers>;
+  // Valid actions in a state, stored inline.
+  using ActionList =
+      FixedVector<Action, GameTraits<State, Action>::kMaxActions>;
+
   virtual void reset() = 0;
   // returns a reward for each player
-  virtual RewardMap simulate(const Action &a) = 0;
+  virtual Reward simulate(const Action &a) = 0;
   // Like above, but doesn't actually modify state
   // TODO: Probably we don't need to keep state in the game, and we can take the
   // state as an input for all these functions.
-  virtual std::pair<State, RewardMap> simulateDry(const State &state,
-                                                  const Action &a) const = 0;
+  virtual std::pair<State, Reward> simulateDry(const State &state,
+                                               const Action &a) const = 0;
+  // StateHash of the state reached by playing a in state, without building
+  // that state. Search code uses this to look up children in its node store.
+  // Games that hash incrementally should override this; the default builds the
+  // child with simulateDry.
+  virtual uint64_t childHash(const State &state, const Action &a) const {
+    return StateHash<State>()(simulateDry(state, a).first);
+  }
   virtual std::vector<Action> getValidActions() const = 0;
+  // Like above, but fills a caller-provided list (clearing it first) so that
+  // it doesn't allocate. Games should override this; the default just copies
+  // from the vector version.
+  virtual void getValidActions(ActionList &actions) const {
+    actions.clear();
+    for (const Action &action : getValidActions()) {
+      actions.push_back(action);
+    }
+  }
+  // Plays uniformly random moves from the current state to the end of the
+  // game, returning the total reward received on the way. Each move is drawn
+  // the same way RandomValidPolicy draws it, so search code calls this instead
+  // of going through the policy one move at a time. Games can override it with
+  // a version that doesn't build action lists.
+  virtual Reward randomPlayout(Rng &rng) {
+    Reward total;
+    ActionList actions;
+    while (!isTerminal()) {
+      getValidActions(actions);
+      total += simulate(actions[rng.uniform(actions.size())]);
+    }
+    return total;
+  }
+  // Plays num_playouts random games from the current state, as above, and
+  // returns their total reward. The game is left in the state it started in.
+  // Games that can run several playouts at once (see ttt::playBatch) should
+  // override this.
+  virtual Reward randomPlayouts(Rng &rng, int num_playouts) {
+    const State start = getCurrentState();
+    Reward total;
+    for (int i = 0; i < num_playouts; i++) {
+      total += randomPlayout(rng);
+      setCurrentState(start);
+    }
+    return total;
+  }
   virtual const State &getCurrentState() const = 0;
+  // Puts the game in state, e.g. to play from a position again.
+  virtual void setCurrentState(const State &state) = 0;
 
   // Returns player number whose turn it is. For two player games, numbers are 0
   // and 1.
   virtual int turn() const = 0;
   virtual bool isTerminal() const = 0;
   virtual std::string render() const = 0;
+  // Independent copy of the game, in the same state, e.g. for another thread
+  // to play on.
+  virtual std::unique_ptr<Game> clone() const = 0;
   virtual ~Game() = default;
 };
 
+// Search code (UCT, MCTS) takes the game type as a template parameter, which
+// defaults to the virtual Game interface. Instantiating it with a concrete,
+// final game class instead lets the compiler call and inline the game's
+// methods directly in the playout loops. The same goes for the actOn methods
+// that policies such as RandomValidPolicy and MCTS have next to act, which
+// take the game's concrete type. Either way the game has to implement
+// Game<State, Action>, so it can still be handed to policies.
+template <class GameT, class State, class Action>
+constexpr bool IsGame = std::is_base_of<Game<State, Action>, GameT>::value;
+
 #endif // MCTS_GAME
@@ -1,31 +1,57 @@
 #ifndef MCTS_MCTS
 #define MCTS_MCTS
+#include "arena.h"
 #include "game.h"
 #include "policy.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include "transposition_table.h"
 
+#include <array>
+#include <atomic>
 #include <iostream>
-#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
-#include <random>
+#include <shared_mutex>
 
 // reward for a state which we haven't explored yet. Higher number here will
 // result in a more optimistic policy.
 constexpr double UNEXPLORED_STATE_REWARD = 0.0;
 
-template <class State, class Action> class MCTS : public Policy<State, Action> {
+// GameT is the game type that training and evaluation are called with. See
+// IsGame in game.h.
+template <class State, class Action, class GameT = Game<State, Action>>
+class MCTS : public Policy<State, Action> {
+  static_assert(IsGame<GameT, State, Action>,
+                "GameT must implement Game<State, Action>");
+
 public:
+  using Reward = typename Game<State, Action>::Reward;
+
   struct Node {
     Node(const State &state_)
         : num_rollouts_involved(0), total_reward_from_here(0), state(state_) {}
     int num_rollouts_involved;
     double total_reward_from_here;
-    std::map<Action, Node *> children;
+    // Head of the list of edges to this node's children, or kNullHandle if it
+    // has none yet.
+    Handle first_child = kNullHandle;
     // let's store the board in the node as well for visualization.
     State state;
   };
 
+  // Link from a node to the child reached by playing action. A node's edges
+  // form a singly linked list through next_sibling.
+  struct Edge {
+    Edge(const Action &action_, Handle child_)
+        : action(action_), child(child_), next_sibling(kNullHandle) {}
+    Action action;
+    Handle child;
+    Handle next_sibling;
+  };
+
   // Vector of these can be used to store history of a rollout.
   struct HistoryFrame {
     HistoryFrame(Action action_, double reward_, const State &state_)
@@ -38,11 +64,12 @@ public:
     State state;
   };
 
-  MCTS() {
-    nodes_.insert(std::make_pair(State(), Node(State())));
-    root_ = &(nodes_.at(State()));
-    eng_ = std::default_random_engine(rd_()); // seed the generator
-    distr_ = std::uniform_real_distribution<float>(0.0, 1.0);
+  // Seeded from the hardware unless a seed is given. With a seed, training
+  // against seeded opponents is reproducible. The random moves used for
+  // exploration come from a separate stream of the same seed.
+  explicit MCTS(uint64_t seed = Rng::randomSeed())
+      : seed_(seed), rng_(seed), random_policy_(seed, /*stream=*/1) {
+    root_ = getOrCreateHandle(State());
   }
 
   // training with eps-greedy policy for self.
@@ -50,9 +77,15 @@ public:
   // learn to throw really hard if we play as o's. Should we fix this by
   // augmenting the state with the player number? Or is there a more elegant way
   // to invert the reward?
-  void train(Game<State, Action> *game, Policy<State, Action> *opponent_policy,
+  //
+  // With num_threads > 1, the rollouts are shared out between that many tasks
+  // on the thread pool, all updating this tree. Each task plays on its own
+  // clone of game and of opponent_policy, which must support clone, and
+  // draws its eps-greedy moves from its own stream.
+  void train(GameT *game, Policy<State, Action> *opponent_policy,
              int num_rollouts = 1, double eps = 1.0,
-             bool opponent_goes_first = false, bool verbose = false) {
+             bool opponent_goes_first = false, bool verbose = false,
+             int num_threads = 1) {
     // eps is the fraction of the time that we choose random policy.
     assert(eps <= 1.0 && eps >= 0.0);
     eps_ = eps;
@@ -60,13 +93,47 @@ public:
     config.update_weights = true;
     config.verbose = verbose;
     config.opponent_goes_first = opponent_goes_first;
-    for (int i = 0; i < num_rollouts; i++) {
-      // pass self as policy
-      rollout(game, this, opponent_policy, config);
+    if (num_threads <= 1) {
+      for (int i = 0; i < num_rollouts; i++) {
+        // pass self as policy
+        rollout(game, this, opponent_policy, config);
+      }
+      return;
+    }
+
+    assert(!verbose && "verbose training is single-threaded");
+    verbose_ = false;
+    concurrent_ = true;
+    // Fresh streams for every call, so that training again with the same
+    // opponent doesn't replay the same games.
+    const uint64_t train_seed = rng_.next();
+    const uint64_t first_stream = next_clone_stream_;
+    next_clone_stream_ += num_threads;
+    std::atomic<int> rollouts_started(0);
+    TaskGroup group;
+    for (int t = 0; t < num_threads; t++) {
+      group.run([&, t]() {
+        std::unique_ptr<Game<State, Action>> thread_game = game->clone();
+        std::unique_ptr<Policy<State, Action>> thread_opponent =
+            opponent_policy->clone(first_stream + t);
+        assert(thread_opponent != nullptr &&
+               "opponent policy must support clone for parallel training");
+        Rng rng(train_seed, t);
+        while (rollouts_started.fetch_add(1, std::memory_order_relaxed) <
+               num_rollouts) {
+          auto rollout_lock = lockForRollout();
+          play(
+              static_cast<GameT *>(thread_game.get()),
+              [&](const GameT *game) { return actOn(game, eps, rng); },
+              thread_opponent.get(), config);
+        }
+      });
     }
+    group.wait();
+    concurrent_ = false;
   }
 
-  std::vector<HistoryFrame> evaluate(Game<State, Action> *game,
+  std::vector<HistoryFrame> evaluate(GameT *game,
                                      Policy<State, Action> *opponent_policy,
                                      bool opponent_goes_first, bool verbose) {
     // when we're evaluating the strength of mcts, we want to be totally greedy
@@ -87,10 +154,372 @@ public:
   // Simulate a rollout with 'self_policy' and 'opponent_policy'.
   // If 'update_weights' is true, keep track of reward and update tree to
   // reflect it.
-  std::vector<HistoryFrame> rollout(Game<State, Action> *game,
+  std::vector<HistoryFrame> rollout(GameT *game,
                                     Policy<State, Action> *self_policy,
                                     Policy<State, Action> *opponent_policy,
                                     const RolloutConfig &config) {
+    verbose_ = config.verbose;
+    return play(
+        game,
+        [&](const GameT *game) {
+          // When training, we are the self policy. Call ourselves directly
+          // so the move choice can be inlined.
+          if (self_policy == this) {
+            return actOn(game);
+          }
+          return self_policy->act(game);
+        },
+        opponent_policy, config);
+  }
+
+  void renderTree(int max_depth) {
+    // how to display the tree? maybe with a BFS
+    std::queue<std::pair<int, Handle>> queue;
+    queue.push(std::make_pair(0, root_));
+    while (!queue.empty()) {
+      std::pair<int, Handle> depth_top = queue.front();
+      int depth = depth_top.first;
+      const Shard &shard = shardOf(depth_top.second);
+      const Node *top = &nodeAt(depth_top.second);
+
+      if (depth > max_depth) {
+        break;
+      }
+
+      queue.pop();
+      top->state.render();
+      std::cout << "num rollouts: " << top->num_rollouts_involved << std::endl;
+      std::cout << "reward: " << top->total_reward_from_here << std::endl;
+      for (Handle edge = top->first_child; edge != kNullHandle;
+           edge = shard.edges[edge].next_sibling) {
+        queue.push(std::make_pair(depth + 1, shard.edges[edge].child));
+      }
+    }
+  }
+
+  // Greedily choose "best" action
+  Action act(const Game<State, Action> *game) override { return actOn(game); }
+
+  // Same as act, but with the concrete game type. See IsGame in game.h.
+  template <class G> Action actOn(const G *game) {
+    assert(!game->isTerminal());
+    typename Game<State, Action>::ActionList valid_actions;
+    game->getValidActions(valid_actions);
+    assert(!valid_actions.empty());
+
+    // eps_ fraction of the time, act randomly.
+    if (rng_.uniformReal() < eps_) {
+      // do something random!
+      return random_policy_.actOn(game);
+    } else {
+
+      // find the "best" state
+      int best_idx = getBestActionIdx(valid_actions, game, verbose_);
+      assert(best_idx >= 0);
+      return valid_actions[best_idx];
+    }
+  };
+
+  // Read-only version of actOn for playing against a frozen tree: eps and the
+  // random draws are passed in instead of coming from the tree, so several
+  // threads can act with the same tree at once, each with its own rng.
+  template <class G>
+  Action actOn(const G *game, double eps, Rng &rng,
+               bool verbose = false) const {
+    assert(!game->isTerminal());
+    typename Game<State, Action>::ActionList valid_actions;
+    game->getValidActions(valid_actions);
+    assert(!valid_actions.empty());
+    if (eps > 0.0 && rng.uniformReal() < eps) {
+      return valid_actions[rng.uniform(valid_actions.size())];
+    }
+    const int best_idx = getBestActionIdx(valid_actions, game, verbose);
+    assert(best_idx >= 0);
+    return valid_actions[best_idx];
+  }
+
+  // Plays one game against opponent_policy without learning from it, using
+  // actOn(game, eps, rng) for our moves, and returns our reward for the last
+  // move. Only reads the tree, so games on different threads can share it
+  // as long as each has its own game, opponent policy and rng.
+  double playGame(GameT *game, Policy<State, Action> *opponent_policy,
+                  bool opponent_goes_first, double eps, Rng &rng) const {
+    game->reset();
+    const int player_num = opponent_goes_first ? 1 : 0;
+    double reward = 0.0;
+    while (!game->isTerminal()) {
+      const Action action = game->turn() == player_num
+                                ? actOn(game, eps, rng)
+                                : opponent_policy->act(game);
+      reward = game->simulate(action).at(player_num);
+    }
+    game->reset();
+    return reward;
+  }
+
+  // valid_actions can be a std::vector or an ActionList.
+  template <class Actions, class G>
+  int getBestActionIdx(const Actions &valid_actions, const G *game,
+                       bool verbose) const {
+    const State &current_state = game->getCurrentState();
+    double best_value_seen = std::numeric_limits<double>::lowest();
+    int best_idx = -1;
+    for (int i = 0; i < valid_actions.size(); i++) {
+      const Action &action = valid_actions[i];
+      // TODO: should i be using the reward from the dry simulation here? Right
+      // now I'm just using the estimated value from my value function.
+      const uint64_t child_hash = game->childHash(current_state, action);
+      double state_value = getExpectedReward(child_hash);
+      if (verbose) {
+        std::cout << "Action " << action.toString()
+                  << " has expected reward: " << state_value << std::endl;
+
+        std::pair<double, int> reward_num_rollouts =
+            getNodeInfo(child_hash);
+        std::cout << "Rollout out " << reward_num_rollouts.second
+                  << " times and received " << reward_num_rollouts.first
+                  << " reward." << std::endl;
+      }
+      if (state_value > best_value_seen) {
+        best_idx = i;
+        best_value_seen = state_value;
+      }
+    }
+    return best_idx;
+  };
+
+  // For introspection. Returns nullptr if state was never visited.
+  const Node *findNode(const State &state) const {
+    return findNode(StateHash<State>()(state));
+  }
+
+  // Same, by state hash.
+  const Node *findNode(uint64_t state_hash) const {
+    const Shard &shard = shards_[shardIndex(state_hash)];
+    Handle local;
+    return shard.index.findShared(state_hash, &local) ? &shard.nodes[local]
+                                                      : nullptr;
+  }
+
+  size_t numNodes() const {
+    size_t num_nodes = 0;
+    for (const Shard &shard : shards_) {
+      num_nodes += shard.nodes.size();
+    }
+    return num_nodes;
+  }
+
+  // Allocates room for about num_nodes nodes up front, so that training
+  // doesn't have to grow the tree.
+  void reserve(size_t num_nodes) {
+    // Leave some room for the shards to come out uneven.
+    const size_t per_shard = num_nodes / kNumShards * 5 / 4 + 16;
+    for (Shard &shard : shards_) {
+      shard.index.reserve(per_shard);
+      shard.nodes.reserve(per_shard);
+      shard.edges.reserve(per_shard);
+    }
+  }
+
+  // Forgets everything learned so far, freeing the whole tree at once.
+  void clear() {
+    for (Shard &shard : shards_) {
+      shard.index.clear();
+      shard.nodes.clear();
+      shard.edges.clear();
+    }
+    root_ = getOrCreateHandle(State());
+  }
+
+  // Plays like this tree with eps-greedy moves, but reads the tree rather
+  // than copying it, so the tree must outlive the clone and shouldn't be
+  // trained while the clone plays. The random draws come from stream
+  // stream + 2 of the tree's seed, since the tree itself uses streams 0 and 1.
+  // Clones of the clone draw from streams split off from that one, see Rng.
+  std::unique_ptr<Policy<State, Action>> clone(uint64_t stream) const override {
+    return std::make_unique<FrozenPolicy>(this, eps_, seed_, stream + 2);
+  }
+
+private:
+  // Nodes are kept in kNumShards shards, picked by the top bits of the state
+  // hash. Each shard has its own index, node and edge arenas, and a lock that
+  // parallel training takes to insert or link nodes in that shard. Lookups,
+  // which are most of the traffic, don't lock at all, see growShard. The node
+  // statistics are updated with atomic adds. A node's edges live in the
+  // node's own shard.
+  //
+  // A node handle is the node's index in its shard's arena, followed by
+  // kShardBits bits of shard number.
+  static constexpr int kShardBits = 4;
+  static constexpr int kNumShards = 1 << kShardBits;
+
+  struct Shard {
+    Shard() : index(/*initial_capacity=*/64) {}
+    // Only taken while concurrent_ is set.
+    std::mutex mutex;
+    TranspositionTable<Handle> index;
+    Arena<Node> nodes;
+    Arena<Edge> edges;
+  };
+
+  // Plays by reading a tree, see clone.
+  class FrozenPolicy : public Policy<State, Action> {
+  public:
+    FrozenPolicy(const MCTS *mcts, double eps, uint64_t seed, uint64_t stream)
+        : mcts_(mcts), eps_(eps), seed_(seed), stream_(stream),
+          rng_(seed, stream) {}
+
+    Action act(const Game<State, Action> *game) override {
+      return mcts_->actOn(game, eps_, rng_);
+    }
+
+    std::unique_ptr<Policy<State, Action>>
+    clone(uint64_t stream) const override {
+      return std::make_unique<FrozenPolicy>(
+          mcts_, eps_, Rng::splitSeed(seed_, stream_), stream);
+    }
+
+  private:
+    const MCTS *mcts_;
+    double eps_;
+    uint64_t seed_;
+    uint64_t stream_;
+    Rng rng_;
+  };
+
+  static int shardIndex(uint64_t state_hash) {
+    return state_hash >> (64 - kShardBits);
+  }
+
+  Shard &shardOf(Handle handle) {
+    return shards_[handle & (kNumShards - 1)];
+  }
+  const Shard &shardOf(Handle handle) const {
+    return shards_[handle & (kNumShards - 1)];
+  }
+
+  // Single-threaded access to a node by handle. Parallel training holds on to
+  // the node pointers getOrCreateNode gave it instead.
+  const Node &nodeAt(Handle handle) const {
+    return shardOf(handle).nodes[handle >> kShardBits];
+  }
+
+  std::unique_lock<std::mutex> lockShard(Shard &shard) {
+    return concurrent_ ? std::unique_lock<std::mutex>(shard.mutex)
+                       : std::unique_lock<std::mutex>();
+  }
+
+  // Find the node for state, creating it if this is the first time we've seen
+  // it.
+  Node *getOrCreateNode(const State &state, Handle *handle) {
+    const uint64_t state_hash = StateHash<State>()(state);
+    const int shard_index = shardIndex(state_hash);
+    Shard &shard = shards_[shard_index];
+    Handle local;
+    if (concurrent_) {
+      local = findOrInsertConcurrent(shard, state_hash, state);
+    } else {
+      auto local_inserted = shard.index.findOrInsert(state_hash);
+      if (local_inserted.second) {
+        local_inserted.first = shard.nodes.allocate(state);
+      }
+      local = local_inserted.first;
+    }
+    *handle = local << kShardBits | shard_index;
+    return &shard.nodes[local];
+  }
+
+  // getOrCreateNode for parallel training. Looks the state up without
+  // locking, and only takes the shard's lock to insert it. A node is allocated
+  // before its handle is published in the index, so a thread that finds the
+  // handle also finds the node.
+  Handle findOrInsertConcurrent(Shard &shard, uint64_t state_hash,
+                                const State &state) {
+    Handle local;
+    if (shard.index.findShared(state_hash, &local)) {
+      return local;
+    }
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    while (!hasRoom(shard)) {
+      lock.unlock();
+      growShard(shard);
+      lock.lock();
+    }
+    // Another thread may have inserted it while we waited for the lock.
+    if (!shard.index.findShared(state_hash, &local)) {
+      local = shard.nodes.allocate(state);
+      shard.index.findOrInsertShared(state_hash, local);
+    }
+    return local;
+  }
+
+  // Whether a node can be inserted into shard without growing its index or
+  // its node arena.
+  static bool hasRoom(const Shard &shard) {
+    return shard.nodes.size() < shard.nodes.capacity() &&
+           shard.index.size() < shard.index.maxSize();
+  }
+
+  // Each rollout of parallel training holds growth_mutex_ shared while it
+  // runs, since its lookups don't lock.
+  std::shared_lock<std::shared_mutex> lockForRollout() {
+    // Waits while a shard grows, which would otherwise never find a moment
+    // when no rollout is running.
+    std::lock_guard<std::mutex> gate(growth_gate_);
+    return std::shared_lock<std::shared_mutex>(growth_mutex_);
+  }
+
+  // Makes room in a full shard during parallel training. Growing the index
+  // or the node arena can move what lock-free lookups are reading, so this
+  // lets go of the calling rollout's hold on growth_mutex_, stops new
+  // rollouts from starting, and waits for the ones in flight to finish or to
+  // wait here too. Node pointers the calling rollout holds stay valid, since
+  // arena elements never move.
+  void growShard(Shard &shard) {
+    growth_mutex_.unlock_shared();
+    {
+      std::lock_guard<std::mutex> gate(growth_gate_);
+      std::lock_guard<std::shared_mutex> growing(growth_mutex_);
+      if (!hasRoom(shard)) {
+        const size_t room = 2 * (size_t)shard.nodes.size() + 64;
+        shard.index.reserve(room);
+        shard.nodes.reserve(room);
+      }
+    }
+    growth_mutex_.lock_shared();
+  }
+
+  Handle getOrCreateHandle(const State &state) {
+    Handle handle;
+    getOrCreateNode(state, &handle);
+    return handle;
+  }
+
+  // The node for the handle of a node that already exists.
+  Node *nodeForUpdate(Handle handle) {
+    return &shardOf(handle).nodes[handle >> kShardBits];
+  }
+
+  // Adds an edge from parent to child for action, unless there is one.
+  void linkChild(Handle parent, Node *parent_node, const Action &action,
+                 Handle child) {
+    Shard &shard = shardOf(parent);
+    auto lock = lockShard(shard);
+    Handle *link = &parent_node->first_child;
+    while (*link != kNullHandle && shard.edges[*link].child != child) {
+      link = &shard.edges[*link].next_sibling;
+    }
+    if (*link == kNullHandle) {
+      *link = shard.edges.allocate(action, child);
+    }
+  }
+
+  // The body of rollout, with our moves chosen by self_act(game). Safe to call
+  // from several threads at once while concurrent_ is set.
+  template <class SelfAct>
+  std::vector<HistoryFrame> play(GameT *game, SelfAct self_act,
+                                 Policy<State, Action> *opponent_policy,
+                                 const RolloutConfig &config) {
     // As we simulate, we want to update the game tree. Each node of the tree
     // stores:
     // - how many rollouts have passed through this node
@@ -100,7 +529,6 @@ public:
 
     // 1. Do a playthrough, keeping track of the actions that were played.
     game->reset();
-    verbose_ = config.verbose;
 
     std::vector<HistoryFrame> rollout_history;
 
@@ -109,7 +537,7 @@ public:
     while (!game->isTerminal()) {
       Action action = [&]() {
         if (game->turn() == player_num) {
-          return self_policy->act(game);
+          return self_act(game);
         } else {
           return opponent_policy->act(game);
         }
@@ -119,13 +547,13 @@ public:
       // own and opponent's actions?
       double reward = game->simulate(action).at(player_num);
       // TODO: wrap this in a toggle-able logger
-      if (verbose_) {
+      if (config.verbose) {
         game->render();
       }
       rollout_history.emplace_back(action, reward, game->getCurrentState());
     }
 
-    if (verbose_) {
+    if (config.verbose) {
       const double final_reward = rollout_history.back().reward;
       if (final_reward == 1.0) {
         std::cout << "mcts won!" << std::endl;
@@ -145,38 +573,39 @@ public:
         rollout_history.begin(), rollout_history.end(), 0.0,
         [&](double a, const HistoryFrame &el) { return a + el.reward; });
 
-    if (verbose_) {
+    if (config.verbose) {
       std::cout << "total reward: " << total_rollout_reward << std::endl;
     }
     auto updateNode = [&](Node *current) {
-      current->num_rollouts_involved++;
       // TODO: this is wrong - we should only receive reward at each node for
       // reward received from that point on, not from the beginning of the
       // rollout. It's okay in tic-tac-toe because we only receive reward at the
       // end anyway.
-      current->total_reward_from_here += total_rollout_reward;
+      if (concurrent_) {
+        atomicFetchAdd(current->num_rollouts_involved, 1);
+        atomicFetchAdd(current->total_reward_from_here, total_rollout_reward);
+      } else {
+        current->num_rollouts_involved++;
+        current->total_reward_from_here += total_rollout_reward;
+      }
     };
 
-    Node *current = root_;
+    Handle current_handle = root_;
+    Node *current = nodeForUpdate(root_);
     updateNode(current);
 
     for (const auto &frame : rollout_history) {
       // Create the node if it doesn't exist.
-      if (nodes_.find(frame.state) == nodes_.end()) {
-        nodes_.insert(std::make_pair(frame.state, Node(frame.state)));
-      }
+      Handle next_handle;
+      Node *next = getOrCreateNode(frame.state, &next_handle);
 
       // Update the parent node to point to the newly created node, if it does
       // not already.
-      const Action &action = frame.action;
-      if (current->children.find(action) == current->children.end()) {
-        current->children.insert(
-            std::make_pair(action, &nodes_.at(frame.state)));
-      }
+      linkChild(current_handle, current, frame.action, next_handle);
 
-      Node &next = nodes_.at(frame.state);
-      updateNode(&next);
-      current = &next;
+      updateNode(next);
+      current_handle = next_handle;
+      current = next;
     }
 
     // reset the game to be a good citizen :)
@@ -184,102 +613,31 @@ public:
     return rollout_history;
   }
 
-  void renderTree(int max_depth) {
-    // how to display the tree? maybe with a BFS
-    std::queue<std::pair<int, const Node *>> queue;
-    queue.push(std::make_pair(0, root_));
-    while (!queue.empty()) {
-      std::pair<int, const Node *> depth_top = queue.front();
-      int depth = depth_top.first;
-      const Node *top = depth_top.second;
-
-      if (depth > max_depth) {
-        break;
-      }
-
-      queue.pop();
-      top->state.render();
-      std::cout << "num rollouts: " << top->num_rollouts_involved << std::endl;
-      std::cout << "reward: " << top->total_reward_from_here << std::endl;
-      for (const auto &action_child : top->children) {
-        const Node *child = action_child.second;
-        queue.push(std::make_pair(depth + 1, child));
-      }
-    }
-  }
-
-  // Greedily choose "best" action
-  Action act(const Game<State, Action> *game) override {
-    assert(!game->isTerminal());
-    std::vector<Action> valid_actions = game->getValidActions();
-    assert(!valid_actions.empty());
 
-    // eps_ fraction of the time, act randomly.
-    float chance = distr_(eng_);
-    if (chance < eps_) {
-      // do something random!
-      return random_policy_.act(game);
-    } else {
-
-      // find the "best" state
-      int best_idx = getBestActionIdx(valid_actions, game, verbose_);
-      assert(best_idx >= 0);
-      return valid_actions[best_idx];
-    }
-  };
-
-  int getBestActionIdx(const std::vector<Action> &valid_actions,
-                       const Game<State, Action> *game, bool verbose) {
-    const State &current_state = game->getCurrentState();
-    double best_value_seen = std::numeric_limits<double>::lowest();
-    int best_idx = -1;
-    for (int i = 0; i < valid_actions.size(); i++) {
-      const Action &action = valid_actions[i];
-      // TODO: should i be using the reward from the dry simulation here? Right
-      // now I'm just using the estimated value from my value function.
-      const std::pair<State, RewardMap> state_reward =
-          game->simulateDry(current_state, action);
-      double state_value = getExpectedReward(state_reward.first);
-      if (verbose) {
-        std::cout << "Action " << action.toString()
-                  << " has expected reward: " << state_value << std::endl;
-
-        std::pair<double, int> reward_num_rollouts =
-            getNodeInfo(state_reward.first);
-        std::cout << "Rollout out " << reward_num_rollouts.second
-                  << " times and received " << reward_num_rollouts.first
-                  << " reward." << std::endl;
-      }
-      if (state_value > best_value_seen) {
-        best_idx = i;
-        best_value_seen = state_value;
-      }
+  double getExpectedReward(uint64_t state_hash) const {
+    const Node *node_ptr = findNode(state_hash);
+    if (node_ptr == nullptr) {
+      return UNEXPLORED_STATE_REWARD;
     }
-    return best_idx;
-  };
-
-  // For introspection
-  const std::map<State, Node> &getNodes() { return nodes_; }
-
-private:
-  double getExpectedReward(const State &state) {
-    if (nodes_.find(state) == nodes_.end()) {
+    const Node &node = *node_ptr;
+    // A node gets its first rollout right after it is created, but during
+    // parallel training another thread may see it in between.
+    const int num_rollouts = atomicLoad(node.num_rollouts_involved);
+    if (num_rollouts == 0) {
+      assert(concurrent_);
       return UNEXPLORED_STATE_REWARD;
     }
-    const Node &node = nodes_.at(state);
-    // If a state gets constructed, it probably should have at least one
-    // rollout.
-    assert(node.num_rollouts_involved != 0);
-    return (node.total_reward_from_here / node.num_rollouts_involved);
+    return atomicLoad(node.total_reward_from_here) / num_rollouts;
   }
 
   // Return (total reward, num rollouts)
   // Just used for debugging.
-  std::pair<double, int> getNodeInfo(const State &state) {
-    if (nodes_.find(state) == nodes_.end()) {
+  std::pair<double, int> getNodeInfo(uint64_t state_hash) const {
+    const Node *node_ptr = findNode(state_hash);
+    if (node_ptr == nullptr) {
       return std::make_pair(0.0, 0);
     }
-    const Node &node = nodes_.at(state);
+    const Node &node = *node_ptr;
     // If a state gets constructed, it probably should have at least one
     // rollout.
     assert(node.num_rollouts_involved != 0);
@@ -292,25 +650,34 @@ private:
   // possible. same with verbose_.
   double eps_;
   bool verbose_;
-  std::random_device rd_; // obtain a random number from hardware
-  std::default_random_engine eng_;
-  std::uniform_real_distribution<float> distr_;
+  uint64_t seed_;
+  Rng rng_;
   RandomValidPolicy<State, Action> random_policy_;
-
-  std::map<State, Node> nodes_;
-  Node *root_;
+  // Next stream for the opponent clones of a parallel train call.
+  uint64_t next_clone_stream_ = 1;
+
+  // Nodes and edges live in arenas and refer to each other by handle. Each
+  // shard's index finds its nodes by state hash.
+  std::array<Shard, kNumShards> shards_;
+  Handle root_;
+  // Set while train runs on several threads, which makes the tree take its
+  // shard locks and update statistics atomically.
+  bool concurrent_ = false;
+  // See lockForRollout and growShard.
+  std::shared_mutex growth_mutex_;
+  std::mutex growth_gate_;
 };
 
 // Like UserInputPolicy, but takes a mcts as input to give hints on what it
 // would do next
-template <class State, class Action>
+template <class State, class Action, class GameT = Game<State, Action>>
 class UserInputPolicyWithHint : public Policy<State, Action> {
 
 private:
-  MCTS<State, Action> *mcts_;
+  MCTS<State, Action, GameT> *mcts_;
 
 public:
-  UserInputPolicyWithHint(MCTS<State, Action> *mcts) { mcts_ = mcts; }
+  UserInputPolicyWithHint(MCTS<State, Action, GameT> *mcts) { mcts_ = mcts; }
   Action act(const Game<State, Action> *game) override {
     assert(!game->isTerminal());
     std::vector<Action> valid_actions = game->getValidActions();
@@ -2,9 +2,11 @@
 #define MCTS_POLICY
 
 #include "game.h"
+#include "rng.h"
 
 #include <iostream>
-#include <random>
+#include <memory>
+#include <type_traits>
 
 // TODO: it might not really make that much sense to have Policy be a separate
 // interface from the class that learns the value function, since a normal
@@ -13,32 +15,81 @@
 template <class State, class Action> class Policy {
 public:
   virtual Action act(const Game<State, Action> *game) = 0;
+  // Independent copy of the policy for another thread to use. Each clone of a
+  // policy should be given its own stream number. Policies that draw random
+  // numbers should draw them from that stream of Rng::splitSeed of their own
+  // seed and stream, so that clones of clones get streams of their own too.
+  // Returns nullptr if the policy can't be copied.
+  virtual std::unique_ptr<Policy> clone(uint64_t /*stream*/) const {
+    return nullptr;
+  }
   virtual ~Policy() = default;
 };
 
 // RandomValidPolicy: Select a random "valid" policy
 template <class State, class Action>
-class RandomValidPolicy : public Policy<State, Action> {
+class RandomValidPolicy final : public Policy<State, Action> {
 public:
-  RandomValidPolicy() {
-    gen = std::mt19937(rd()); // seed the generator
+  // Seeded from the hardware unless a seed is given. Policies that should be
+  // independent but reproducible, e.g. one per thread, can share a seed and
+  // use different streams.
+  explicit RandomValidPolicy(uint64_t seed = Rng::randomSeed(),
+                             uint64_t stream = 0)
+      : seed_(seed), stream_(stream), rng_(seed, stream) {}
+  Action act(const Game<State, Action> *game) override { return actOn(game); }
+
+  std::unique_ptr<Policy<State, Action>> clone(uint64_t stream) const override {
+    return std::make_unique<RandomValidPolicy>(Rng::splitSeed(seed_, stream_),
+                                               stream);
   }
-  Action act(const Game<State, Action> *game) override {
+
+  // Same as act, but with the concrete game type. See IsGame in game.h.
+  template <class GameT> Action actOn(const GameT *game) {
     assert(!game->isTerminal());
-    std::vector<Action> valid_actions = game->getValidActions();
-    assert(!valid_actions.empty());
+    game->getValidActions(valid_actions_);
+    assert(!valid_actions_.empty());
 
     // choose a random action in range
-    std::uniform_int_distribution<> distr(0, valid_actions.size() - 1);
-    int random_idx = distr(gen);
-    return valid_actions.at(random_idx);
+    return valid_actions_[rng_.uniform(valid_actions_.size())];
   }
 
+  // The generator moves are drawn from. Search code hands it to
+  // Game::randomPlayout to play whole playouts the way this policy would.
+  Rng &rng() { return rng_; }
+
 private:
-  std::random_device rd; // obtain a random number from hardware
-  std::mt19937 gen;
+  // Scratch space, kept around so act doesn't allocate.
+  typename Game<State, Action>::ActionList valid_actions_;
+  uint64_t seed_;
+  uint64_t stream_;
+  Rng rng_;
 };
 
+// Calls policy->act(game), or RandomValidPolicy::actOn when PolicyT is known
+// to be a RandomValidPolicy at compile time, so that search code templated on
+// its game and policy types can inline the whole playout.
+template <class State, class Action, class PolicyT, class GameT>
+Action actWith(PolicyT *policy, const GameT *game) {
+  if constexpr (std::is_same<PolicyT, RandomValidPolicy<State, Action>>::value) {
+    return policy->actOn(game);
+  } else {
+    return policy->act(game);
+  }
+}
+
+// Returns the generator of policy if it is a RandomValidPolicy, so its moves
+// can be played with Game::randomPlayout, or nullptr otherwise.
+template <class State, class Action, class PolicyT>
+Rng *randomPlayoutRng(PolicyT *policy) {
+  if constexpr (std::is_same<PolicyT, RandomValidPolicy<State, Action>>::value) {
+    return &policy->rng();
+  } else {
+    auto *random_policy =
+        dynamic_cast<RandomValidPolicy<State, Action> *>(policy);
+    return random_policy == nullptr ? nullptr : &random_policy->rng();
+  }
+}
+
 // UserInputPolicy: Tells user the list of valid inputs, and prompts user for a
 // choice.
 template <class State, class Action>
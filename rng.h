@@ -0,0 +1,131 @@
+#ifndef MCTS_RNG
+#define MCTS_RNG
+
+#include <cstdint>
+#include <limits>
+#include <random>
+
+// xoshiro256** pseudo random number generator, which every policy and search
+// uses for its random draws. It is small, fast, and can be seeded explicitly so
+// runs are reproducible.
+//
+// Generators built from the same seed but different stream numbers are
+// independent: stream k starts 2^128 * k draws into the sequence, so as long as
+// no stream makes 2^128 draws they never overlap. Give each thread its own
+// stream. A generator that hands out streams to others, such as a policy
+// cloned for each thread whose clones may be cloned again, hands out streams
+// of splitSeed(seed, stream) instead of its own seed.
+//
+// Satisfies UniformRandomBitGenerator, so it also works with the <random>
+// distributions.
+class Rng {
+public:
+  using result_type = uint64_t;
+
+  explicit Rng(uint64_t seed = 0, uint64_t stream = 0) {
+    // Expand the seed into the 256-bit state with splitmix64, as recommended
+    // by the xoshiro authors. This never produces the all-zero state.
+    for (uint64_t &word : s_) {
+      seed += 0x9e3779b97f4a7c15ULL;
+      word = mix(seed);
+    }
+    for (uint64_t i = 0; i < stream; i++) {
+      jump();
+    }
+  }
+
+  // Seed for the streams split off from stream `stream` of `seed`, so that
+  // streams handed out from different streams never coincide with each other
+  // or with the streams of seed itself, short of a 64-bit hash collision.
+  static uint64_t splitSeed(uint64_t seed, uint64_t stream) {
+    return mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ULL));
+  }
+
+  // A seed from the hardware, for runs that don't need to be reproducible.
+  static uint64_t randomSeed() {
+    std::random_device rd;
+    return ((uint64_t)rd() << 32) ^ rd();
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() { return next(); }
+
+  uint64_t next() {
+    const uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  // Uniform integer in [0, bound), bound > 0. Draws are masked down to the
+  // smallest power of two covering bound and rejected if too large, so there
+  // is no modulo bias and no division. Each 64-bit draw supplies several
+  // candidates, and fewer than half of the candidates are rejected.
+  uint32_t uniform(uint32_t bound) {
+    if (bound <= 1) {
+      return 0;
+    }
+    const int bits = 32 - __builtin_clz(bound - 1);
+    const uint64_t mask = (1ULL << bits) - 1;
+    while (true) {
+      uint64_t draw = next();
+      for (int used = 0; used + bits <= 64; used += bits) {
+        const uint32_t candidate = draw & mask;
+        if (candidate < bound) {
+          return candidate;
+        }
+        draw >>= bits;
+      }
+    }
+  }
+
+  // Uniform double in [0, 1), from the top 53 bits of a draw.
+  double uniformReal() { return (next() >> 11) * 0x1.0p-53; }
+
+  // Advances the state by 2^128 draws. Used to split off independent streams.
+  void jump() {
+    static constexpr uint64_t kJump[] = {0x180ec6d33cfd0abaULL,
+                                         0xd5a61266f0c9392cULL,
+                                         0xa9582618e03fc9aaULL,
+                                         0x39abdc4529b1661cULL};
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (const uint64_t jump : kJump) {
+      for (int b = 0; b < 64; b++) {
+        if (jump & (1ULL << b)) {
+          s0 ^= s_[0];
+          s1 ^= s_[1];
+          s2 ^= s_[2];
+          s3 ^= s_[3];
+        }
+        next();
+      }
+    }
+    s_[0] = s0;
+    s_[1] = s1;
+    s_[2] = s2;
+    s_[3] = s3;
+  }
+
+private:
+  // The splitmix64 finalizer.
+  static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t s_[4];
+};
+
+#endif // MCTS_RNG
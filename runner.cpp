@@ -1,23 +1,37 @@
 #include "tic-tac-toe.h"
 #include "uct.h"
 
+#include <chrono>
+#include <cstdlib>
+
 typedef TTTState State;
 typedef TTTAction Action;
 
-int main() {
-  std::unique_ptr<Game<State, Action>> game = std::make_unique<TicTacToe>();
-  std::unique_ptr<Policy<State, Action>> random_policy =
-      std::make_unique<RandomValidPolicy<State, Action>>();
-  UCT<State, Action> uct;
+int main(int argc, char **argv) {
+  // Pass a seed as the first argument to make the rollouts reproducible, e.g.
+  // to compare timings between builds.
+  const uint64_t seed =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : Rng::randomSeed();
+
+  // Use the concrete game and policy types so rollouts call straight into them.
+  std::unique_ptr<TicTacToe> game = std::make_unique<TicTacToe>();
+  std::unique_ptr<RandomValidPolicy<State, Action>> random_policy =
+      std::make_unique<RandomValidPolicy<State, Action>>(seed);
+  UCT<State, Action, TicTacToe> uct;
 
-  // rollout
+  // Search for a second on every core, or until 10000 rollouts are done.
   {
-    for (int i = 0; i < 10000; i++) {
-      if (i % 100 == 0) {
-        std::cout << "rollout iteration: " << i << std::endl;
-      }
-      uct.rollout(game.get(), random_policy.get());
-    }
+    const int num_threads = ThreadPool::global().concurrency();
+    auto budget = UCT<State, Action, TicTacToe>::SearchBudget::forDuration(
+        std::chrono::seconds(1));
+    budget.max_rollouts = 10000;
+    const auto result =
+        uct.search(game.get(), random_policy.get(), budget, num_threads);
+    std::cout << "ran " << result.num_rollouts << " rollouts on "
+              << num_threads << " threads in "
+              << std::chrono::duration<double>(result.elapsed).count()
+              << "s, creating " << result.num_nodes_created << " nodes"
+              << std::endl;
   }
   // mcts.renderTree(/*max_depth=*/3);
 
@@ -30,8 +44,20 @@ int main() {
   char play;
   std::cin >> play;
   while (play == 'y') {
-    uct.evaluate(game.get(), opponent_policy.get(),
-                 /*opponent_goes_first*/ true);
+    // Keep searching from each position the game reaches, reusing what the
+    // searches so far learned about it, and ponder while you think.
+    const double reward = uct.playSearching(
+        game.get(), opponent_policy.get(), /*opponent_goes_first=*/true,
+        random_policy.get(), std::chrono::milliseconds(100),
+        ThreadPool::global().concurrency(), /*verbose=*/true,
+        /*ponder=*/true);
+    if (reward == 1.0) {
+      std::cout << "mcts won!" << std::endl;
+    } else if (reward == -1.0) {
+      std::cout << "opponent won!" << std::endl;
+    } else {
+      std::cout << "it's a draw!" << std::endl;
+    }
     std::cout << "Play a game? ;) (y/n)" << std::endl;
     std::cin >> play;
   }
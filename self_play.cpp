@@ -8,28 +8,33 @@
 
 typedef TTTState State;
 typedef TTTAction Action;
+typedef MCTS<State, Action, TicTacToe> TTTMCTS;
 
 int main() {
   // Let's seed a first player tree by playing against randoms
-  std::unique_ptr<Game<State, Action>> game = std::make_unique<TicTacToe>();
-  MCTS<State, Action> first_player_mcts;
+  std::unique_ptr<TicTacToe> game = std::make_unique<TicTacToe>();
+  // Train on every core.
+  const int num_threads = ThreadPool::global().concurrency();
+  TTTMCTS first_player_mcts;
   {
     auto opponent_policy = std::make_unique<RandomValidPolicy<State, Action>>();
     FixedEpsilonScheduler sched(0.05);
     first_player_mcts.train(game.get(), opponent_policy.get(), 20000,
                             sched.getEpsilon(),
-                            /*opponent_goes_first*/ false);
+                            /*opponent_goes_first*/ false, /*verbose=*/false,
+                            num_threads);
     std::cout << "finished training first player tree." << std::endl;
   }
 
-  MCTS<State, Action> second_player_mcts;
+  TTTMCTS second_player_mcts;
   {
     // For some reason the second player learns a lot better with eps = 1.0
     auto opponent_policy = std::make_unique<RandomValidPolicy<State, Action>>();
     FixedEpsilonScheduler sched(1.0);
     second_player_mcts.train(game.get(), opponent_policy.get(), 20000,
                              sched.getEpsilon(),
-                             /*opponent_goes_first*/ true);
+                             /*opponent_goes_first*/ true, /*verbose=*/false,
+                             num_threads);
     std::cout << "finished training second player tree." << std::endl;
   }
 
@@ -40,21 +45,24 @@ int main() {
     bool training_first_player = i % 2 == 0;
     std::cout << "self play iteration: " << i << std::endl;
     // trainee will learn from playing the trainer.
-    MCTS<State, Action> *trainee =
+    TTTMCTS *trainee =
         training_first_player ? &first_player_mcts : &second_player_mcts;
-    MCTS<State, Action> *trainer =
+    TTTMCTS *trainer =
         training_first_player ? &second_player_mcts : &first_player_mcts;
 
     bool opponent_goes_first = !training_first_player;
 
+    // Each thread plays against its own clone of the trainer, which reads the
+    // trainer's tree.
     trainee->train(game.get(), trainer, NUM_ROLLOUTS_PER_SELF_PLAY_EPOCH,
-                   /*eps=*/0.05, opponent_goes_first);
+                   /*eps=*/0.05, opponent_goes_first, /*verbose=*/false,
+                   num_threads);
   }
 
   // play against the second player tree
 
   auto opponent_policy =
-      std::make_unique<UserInputPolicyWithHint<State, Action>>(
+      std::make_unique<UserInputPolicyWithHint<State, Action, TicTacToe>>(
           &first_player_mcts);
   std::cout << "Play a game? ;) (y/n)" << std::endl;
   char play;
@@ -2,11 +2,21 @@
                           // in one cpp file
 #include "catch_amalgamated.hpp"
 
+#include "arena.h"
 #include "mcts.h"
 #include "tic-tac-toe.h"
 #include "uct.h"
+#include "utils.h"
 
 #include "policy.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include "transposition_table.h"
+#include "ucb.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 typedef TTTState State;
 typedef TTTAction Action;
@@ -55,16 +65,15 @@ TEST_CASE("Basic rollout backprop is working", "[mcts]") {
   auto rollout_history = mcts.rollout(game.get(), self_policy.get(),
                                       opponent_policy.get(), config);
 
-  // get the nodes for introspection
-  const auto &nodes = mcts.getNodes();
 
   for (const auto &frame : rollout_history) {
     std::cout << "Verifying assumptions for state: " << frame.state.render()
               << std::endl;
-    REQUIRE(nodes.find(frame.state) != nodes.end());
-    REQUIRE(nodes.at(frame.state).num_rollouts_involved == 1);
+    const auto *node = mcts.findNode(frame.state);
+    REQUIRE(node != nullptr);
+    REQUIRE(node->num_rollouts_involved == 1);
     // Each frame should have a positive reward since we won.
-    REQUIRE(nodes.at(frame.state).total_reward_from_here == Approx(1.0));
+    REQUIRE(node->total_reward_from_here == Approx(1.0));
   }
 }
 
@@ -93,16 +102,15 @@ TEST_CASE("Rollout backprop loss when playing as player 2", "[mcts]") {
   auto rollout_history = mcts.rollout(game.get(), self_policy.get(),
                                       opponent_policy.get(), config);
 
-  // get the nodes for introspection
-  const auto &nodes = mcts.getNodes();
 
   for (const auto &frame : rollout_history) {
     std::cout << "Verifying assumptions for state: " << std::endl;
     frame.state.render();
-    REQUIRE(nodes.find(frame.state) != nodes.end());
-    REQUIRE(nodes.at(frame.state).num_rollouts_involved == 1);
+    const auto *node = mcts.findNode(frame.state);
+    REQUIRE(node != nullptr);
+    REQUIRE(node->num_rollouts_involved == 1);
     // Each frame should have a negative reward since we lost.
-    REQUIRE(nodes.at(frame.state).total_reward_from_here == Approx(-1.0));
+    REQUIRE(node->total_reward_from_here == Approx(-1.0));
   }
 }
 
@@ -131,28 +139,882 @@ TEST_CASE("Rollout backprop win when playing as player 2", "[mcts]") {
   auto rollout_history = mcts.rollout(game.get(), self_policy.get(),
                                       opponent_policy.get(), config);
 
-  // get the nodes for introspection
-  const auto &nodes = mcts.getNodes();
 
   for (const auto &frame : rollout_history) {
     std::cout << "Verifying assumptions for state: " << std::endl;
     frame.state.render();
-    REQUIRE(nodes.find(frame.state) != nodes.end());
-    REQUIRE(nodes.at(frame.state).num_rollouts_involved == 1);
+    const auto *node = mcts.findNode(frame.state);
+    REQUIRE(node != nullptr);
+    REQUIRE(node->num_rollouts_involved == 1);
     // Each frame should have a positive reward since we lost.
-    REQUIRE(nodes.at(frame.state).total_reward_from_here == Approx(1.0));
+    REQUIRE(node->total_reward_from_here == Approx(1.0));
   }
 }
 
 TEST_CASE("Test rewardmap plus operator", "[RewardMap]") {
-  RewardMap a = RewardMap({{0, 1.0}, {1, 2.0}});
-  RewardMap b = RewardMap({{0, 4.0}, {1, -2.0}});
+  RewardMap<2> a = RewardMap<2>({1.0, 2.0});
+  RewardMap<2> b = RewardMap<2>({4.0, -2.0});
 
-  RewardMap c = a + b;
+  RewardMap<2> c = a + b;
   REQUIRE(c.at(0) == Approx(5.0));
   REQUIRE(c.at(1) == Approx(0.0));
 }
 
+TEST_CASE("Transposition table finds what it inserted", "[TranspositionTable]") {
+  TranspositionTable<int> table(/*initial_capacity=*/4);
+  // Enough keys to force a few rehashes, including the reserved zero key.
+  for (uint64_t key = 0; key < 1000; key++) {
+    auto value_inserted = table.findOrInsert(key * 7919);
+    REQUIRE(value_inserted.second);
+    value_inserted.first = (int)key;
+  }
+  REQUIRE(table.size() == 1000);
+  for (uint64_t key = 0; key < 1000; key++) {
+    REQUIRE(table.find(key * 7919) != nullptr);
+    REQUIRE(*table.find(key * 7919) == (int)key);
+    REQUIRE_FALSE(table.findOrInsert(key * 7919).second);
+  }
+  REQUIRE(table.find(1) == nullptr);
+
+  table.clear();
+  REQUIRE(table.size() == 0);
+  REQUIRE(table.find(0) == nullptr);
+}
+
+TEST_CASE("Transposition table inserts from several threads",
+          "[TranspositionTable]") {
+  TranspositionTable<int> table;
+  const int kKeys = 2000;
+  const int kThreads = 4;
+  table.reserve(kKeys);
+  // Every thread inserts every key, offering its own thread number as the
+  // value. Exactly one insertion per key wins, and everyone sees its value.
+  std::vector<std::vector<int>> seen(kThreads, std::vector<int>(kKeys));
+  std::vector<int> wins(kThreads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kKeys; i++) {
+        const uint64_t key = (uint64_t)((i * 7919 + t * 13) % kKeys) << 20;
+        const auto stored = table.findOrInsertShared(key, t);
+        seen[t][key >> 20] = stored->first;
+        wins[t] += stored->second;
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(table.size() == kKeys);
+  REQUIRE(wins[0] + wins[1] + wins[2] + wins[3] == kKeys);
+  for (int i = 0; i < kKeys; i++) {
+    int value = -1;
+    REQUIRE(table.findShared((uint64_t)i << 20, &value));
+    for (int t = 0; t < kThreads; t++) {
+      REQUIRE(seen[t][i] == value);
+    }
+  }
+
+  // Without room to rehash into, a full table turns new keys away but still
+  // finds the ones it has.
+  TranspositionTable<int> small(16);
+  int num_inserted = 0;
+  for (uint64_t key = 1; small.findOrInsertShared(key, (int)key); key++) {
+    num_inserted++;
+  }
+  REQUIRE(num_inserted == 8);
+  REQUIRE_FALSE(small.findShared(100, &num_inserted));
+  REQUIRE(small.findOrInsertShared(3, 0)->first == 3);
+  REQUIRE_FALSE(small.findOrInsertShared(3, 0)->second);
+}
+
+TEST_CASE("Thread pool runs nested task groups", "[ThreadPool]") {
+  ThreadPool pool(3);
+  std::atomic<int> count(0);
+  {
+    TaskGroup outer(pool);
+    for (int i = 0; i < 8; i++) {
+      outer.run([&]() {
+        // Waiting on the inner group runs its tasks rather than blocking a
+        // worker, so nesting can't run out of threads.
+        TaskGroup inner(pool);
+        for (int j = 0; j < 100; j++) {
+          inner.run([&]() { count++; });
+        }
+        inner.wait();
+      });
+    }
+    outer.wait();
+  }
+  REQUIRE(count == 800);
+
+  // Without workers, the waiting thread runs everything itself.
+  ThreadPool no_workers(0);
+  TaskGroup group(no_workers);
+  for (int i = 0; i < 10; i++) {
+    group.run([&]() { count++; });
+  }
+  group.wait();
+  REQUIRE(count == 810);
+}
+
+TEST_CASE("Cancelled task groups skip their queued tasks", "[ThreadPool]") {
+  ThreadPool pool(0);
+  int count = 0;
+  TaskGroup group(pool);
+  for (int i = 0; i < 10; i++) {
+    // Tasks from outside the pool run oldest first, so only the first one
+    // runs before the group is cancelled.
+    group.run([&]() {
+      count++;
+      group.cancel();
+    });
+  }
+  group.wait();
+  REQUIRE(group.cancelled());
+  REQUIRE(count == 1);
+}
+
+TEST_CASE("Arena handles stay valid as it grows", "[Arena]") {
+  Arena<uint64_t> arena;
+  const uint64_t *first = &arena[arena.allocate(42)];
+  // Spill over several chunks.
+  for (uint64_t i = 1; i < 3 * Arena<uint64_t>::kChunkSize; i++) {
+    REQUIRE(arena.allocate(i * 2) == i);
+  }
+  REQUIRE(first == &arena[0]);
+  REQUIRE(*first == 42);
+  REQUIRE(arena[Arena<uint64_t>::kChunkSize + 1] ==
+          2 * (Arena<uint64_t>::kChunkSize + 1));
+
+  arena.clear();
+  REQUIRE(arena.size() == 0);
+  REQUIRE(arena.allocate(7) == 0);
+
+  // allocateShared can't add chunks, so it stops at the reserved ones.
+  Arena<uint64_t> unreserved;
+  REQUIRE(unreserved.allocateShared(1) == kNullHandle);
+  unreserved.reserve(1);
+  for (uint32_t i = 0; i < Arena<uint64_t>::kChunkSize; i++) {
+    REQUIRE(unreserved.allocateShared(i) == i);
+  }
+  REQUIRE(unreserved.allocateShared(1) == kNullHandle);
+  REQUIRE(unreserved.size() == Arena<uint64_t>::kChunkSize);
+}
+
+TEST_CASE("MCTS tree can be reset in bulk", "[mcts]") {
+  MCTS<State, Action> mcts;
+  std::unique_ptr<Game<State, Action>> game = std::make_unique<TicTacToe>();
+  auto opponent_policy = std::make_unique<RandomValidPolicy<State, Action>>();
+  mcts.reserve(1000);
+  mcts.train(game.get(), opponent_policy.get(), /*num_rollouts=*/50);
+  REQUIRE(mcts.numNodes() > 1);
+  REQUIRE(mcts.findNode(State())->num_rollouts_involved == 50);
+
+  mcts.clear();
+  REQUIRE(mcts.numNodes() == 1);
+  REQUIRE(mcts.findNode(State())->num_rollouts_involved == 0);
+}
+
+TEST_CASE("Evaluation games run in parallel on a frozen tree", "[mcts]") {
+  MCTS<State, Action, TicTacToe> mcts(/*seed=*/1);
+  TicTacToe game;
+  RandomValidPolicy<State, Action> opponent_policy(2);
+  mcts.train(&game, &opponent_policy, /*num_rollouts=*/2000);
+  const size_t num_nodes = mcts.numNodes();
+
+  // The counts only depend on the seed, not on how many threads play.
+  ThreadPool serial(0);
+  ThreadPool parallel(3);
+  const EvaluationCounts serial_counts = playAgainstRandomOpponent(
+      &mcts, &game, /*opponent_goes_first=*/false, /*num_games=*/305,
+      /*seed=*/7, serial);
+  const EvaluationCounts parallel_counts = playAgainstRandomOpponent(
+      &mcts, &game, /*opponent_goes_first=*/false, /*num_games=*/305,
+      /*seed=*/7, parallel);
+  REQUIRE(serial_counts.numGames() == 305);
+  REQUIRE(parallel_counts.wins == serial_counts.wins);
+  REQUIRE(parallel_counts.losses == serial_counts.losses);
+  REQUIRE(parallel_counts.draws == serial_counts.draws);
+  // Evaluation doesn't learn, and the trained tree beats a random player.
+  REQUIRE(mcts.numNodes() == num_nodes);
+  REQUIRE(serial_counts.wins > serial_counts.losses);
+}
+
+TEST_CASE("MCTS trains on several threads", "[mcts]") {
+  MCTS<State, Action, TicTacToe> mcts(/*seed=*/3);
+  TicTacToe game;
+  RandomValidPolicy<State, Action> opponent_policy(4);
+  mcts.train(&game, &opponent_policy, /*num_rollouts=*/2001, /*eps=*/1.0,
+             /*opponent_goes_first=*/false, /*verbose=*/false,
+             /*num_threads=*/4);
+  REQUIRE(mcts.findNode(State())->num_rollouts_involved == 2001);
+  // Every game went through exactly one of the first moves.
+  int first_move_rollouts = 0;
+  for (int pos = 0; pos < 9; pos++) {
+    game.reset();
+    game.simulate(Action(pos));
+    const auto *child = mcts.findNode(game.getCurrentState());
+    if (child != nullptr) {
+      first_move_rollouts += child->num_rollouts_involved;
+    }
+  }
+  game.reset();
+  REQUIRE(first_move_rollouts == 2001);
+
+  // A trained tree can be the opponent of another tree's parallel training,
+  // with each thread playing against a clone that reads it.
+  MCTS<State, Action, TicTacToe> second_player(/*seed=*/5);
+  second_player.train(&game, &mcts, /*num_rollouts=*/500, /*eps=*/1.0,
+                      /*opponent_goes_first=*/true, /*verbose=*/false,
+                      /*num_threads=*/4);
+  REQUIRE(second_player.findNode(State())->num_rollouts_involved == 500);
+}
+
+TEST_CASE("Zobrist hash depends only on the position", "[tic-tac-toe]") {
+  TicTacToe game;
+  REQUIRE(game.getCurrentState().hash == 0);
+
+  for (int pos : {0, 4, 8}) {
+    game.simulate(Action(pos));
+  }
+  const TTTState forward = game.getCurrentState();
+
+  game.reset();
+  for (int pos : {8, 4, 0}) {
+    game.simulate(Action(pos));
+  }
+  // Same position reached by a different move order.
+  REQUIRE(game.getCurrentState() == forward);
+  REQUIRE(game.getCurrentState().hash == forward.hash);
+
+  // simulateDry and childHash compute the same hash as actually playing the
+  // move.
+  const TTTState dry = game.simulateDry(forward, Action(2)).first;
+  REQUIRE(game.childHash(forward, Action(2)) == dry.hash);
+  game.simulate(Action(2));
+  REQUIRE(dry.hash == game.getCurrentState().hash);
+
+  // And a different position hashes differently.
+  game.reset();
+  for (int pos : {0, 4, 7}) {
+    game.simulate(Action(pos));
+  }
+  REQUIRE(game.getCurrentState().hash != forward.hash);
+}
+
+TEST_CASE("Vectorized UCB selection matches the scalar version", "[ucb]") {
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<int32_t> visits_distr(1, 50);
+  std::uniform_real_distribution<double> reward_distr(-1.0, 1.0);
+  for (int num_children = 1; num_children <= 13; num_children++) {
+    for (int trial = 0; trial < 100; trial++) {
+      std::vector<int32_t> visits(num_children);
+      std::vector<double> total_reward(num_children);
+      int parent_visits = 1;
+      for (int i = 0; i < num_children; i++) {
+        visits[i] = visits_distr(gen);
+        total_reward[i] = reward_distr(gen) * visits[i];
+        parent_visits += visits[i];
+      }
+      // Some trials get an unexplored child, some get exact ties.
+      if (trial % 3 == 0) {
+        visits[trial % num_children] = 0;
+      } else if (trial % 3 == 1 && num_children > 1) {
+        visits[num_children - 1] = visits[0];
+        total_reward[num_children - 1] = total_reward[0];
+      }
+      const double log_parent = log((double)parent_visits);
+      REQUIRE(selectUcb(visits.data(), total_reward.data(), num_children,
+                        log_parent, 1.41) ==
+              selectUcbScalar(visits.data(), total_reward.data(), num_children,
+                              log_parent, 1.41));
+    }
+  }
+}
+
+TEST_CASE("Rng is reproducible and draws in range", "[rng]") {
+  Rng a(42), b(42), c(43);
+  bool differs = false;
+  for (int i = 0; i < 100; i++) {
+    const uint64_t x = a.next();
+    REQUIRE(x == b.next());
+    differs |= x != c.next();
+  }
+  REQUIRE(differs);
+
+  // Streams of the same seed don't start on the same sequence.
+  Rng stream0(42, 0), stream1(42, 1);
+  REQUIRE(stream0.next() != stream1.next());
+
+  Rng rng(7);
+  int counts[9] = {};
+  for (int i = 0; i < 9000; i++) {
+    const uint32_t draw = rng.uniform(9);
+    REQUIRE(draw < 9);
+    counts[draw]++;
+    const double real = rng.uniformReal();
+    REQUIRE(real >= 0.0);
+    REQUIRE(real < 1.0);
+  }
+  for (int count : counts) {
+    REQUIRE(count > 800);
+    REQUIRE(count < 1200);
+  }
+  REQUIRE(rng.uniform(1) == 0);
+}
+
+TEST_CASE("Seeded random policies play the same moves", "[rng]") {
+  TicTacToe game_a, game_b;
+  RandomValidPolicy<State, Action> policy_a(5), policy_b(5);
+  while (!game_a.isTerminal()) {
+    const Action action = policy_a.act(&game_a);
+    REQUIRE(action.board_position == policy_b.act(&game_b).board_position);
+    game_a.simulate(action);
+    game_b.simulate(action);
+  }
+}
+
+TEST_CASE("Clones of cloned policies play their own games", "[rng]") {
+  // Search threads play with clones of the simulation policy, and their leaf
+  // workers with clones of those. Each worker's first playout differs from
+  // every other's.
+  RandomValidPolicy<State, Action> policy(9);
+  std::vector<std::unique_ptr<Policy<State, Action>>> workers;
+  workers.push_back(policy.clone(1));
+  workers.push_back(policy.clone(2));
+  workers.push_back(workers[0]->clone(1));
+  workers.push_back(workers[0]->clone(2));
+  workers.push_back(workers[1]->clone(1));
+  std::vector<std::vector<int>> playouts;
+  for (const auto &worker : workers) {
+    TicTacToe game;
+    std::vector<int> moves;
+    while (!game.isTerminal()) {
+      const Action action = worker->act(&game);
+      moves.push_back(action.board_position);
+      game.simulate(action);
+    }
+    playouts.push_back(moves);
+  }
+  for (size_t i = 0; i < playouts.size(); i++) {
+    for (size_t j = i + 1; j < playouts.size(); j++) {
+      REQUIRE(playouts[i] != playouts[j]);
+    }
+  }
+}
+
+TEST_CASE("Light playouts play the same games as a random policy", "[rng]") {
+  for (uint64_t seed = 0; seed < 50; seed++) {
+    // TicTacToe's own playout, the generic one, and a RandomValidPolicy drawing
+    // from the same seed all pick the same moves.
+    TicTacToe light, generic, stepped;
+    Rng light_rng(seed), generic_rng(seed);
+    const auto light_reward = light.randomPlayout(light_rng);
+    const auto generic_reward =
+        generic.Game<State, Action>::randomPlayout(generic_rng);
+    RandomValidPolicy<State, Action> policy(seed);
+    while (!stepped.isTerminal()) {
+      stepped.simulate(policy.act(&stepped));
+    }
+    REQUIRE(light.getCurrentState() == stepped.getCurrentState());
+    REQUIRE(generic.getCurrentState() == stepped.getCurrentState());
+    REQUIRE(light.getCurrentState().hash == stepped.getCurrentState().hash);
+    REQUIRE(light_reward.data == generic_reward.data);
+    REQUIRE(light_reward.data ==
+            (light.getCurrentState().status == TTTState::Status::kXWon
+                 ? TwoPlayerFirstPlayerWinsReward
+             : light.getCurrentState().status == TTTState::Status::kOWon
+                 ? TwoPlayerSecondPlayerWinsReward
+                 : TwoPlayerNobodyWinsReward)
+                .data);
+  }
+
+  // A game that is already over plays no moves and receives nothing.
+  TicTacToe light, generic;
+  for (int pos : {0, 3, 1, 4, 2}) {
+    light.simulate(TTTAction(pos));
+  }
+  const TTTState x_won = light.getCurrentState();
+  generic.setCurrentState(x_won);
+  Rng light_rng(1), generic_rng(1);
+  const auto light_reward = light.randomPlayout(light_rng);
+  const auto generic_reward =
+      generic.Game<State, Action>::randomPlayout(generic_rng);
+  REQUIRE(light_reward.data == generic_reward.data);
+  REQUIRE(light_reward.at(0) == 0.0);
+  REQUIRE(light_reward.at(1) == 0.0);
+  REQUIRE(light.getCurrentState() == x_won);
+}
+
+TEST_CASE("Batched playouts match random play", "[tic-tac-toe]") {
+  Rng rng(11);
+  // Random games from the empty board: x wins about 58.5% of the time, o
+  // about 28.8%, and 12.7% are drawn.
+  const int n = 32000;
+  const ttt::PlayoutCounts counts = ttt::playOutcomes(TTTState(), n, rng);
+  REQUIRE(counts.x_wins + counts.o_wins + counts.draws == n);
+  REQUIRE(std::abs(counts.x_wins / (double)n - 0.585) < 0.015);
+  REQUIRE(std::abs(counts.o_wins / (double)n - 0.288) < 0.015);
+  REQUIRE(std::abs(counts.draws / (double)n - 0.127) < 0.015);
+
+  // Lanes can start from different positions, finished or not.
+  TicTacToe game;
+  for (int pos : {0, 3, 1, 4}) {
+    game.simulate(TTTAction(pos));
+  }
+  const TTTState x_to_win = game.getCurrentState();
+  game.simulate(TTTAction(2));
+  const TTTState x_won = game.getCurrentState();
+  game.reset();
+  for (int pos : {0, 1, 2, 4, 3, 5, 7, 6}) {
+    game.simulate(TTTAction(pos));
+  }
+  // Only square 8 is left, and it doesn't make a line.
+  const TTTState one_left = game.getCurrentState();
+
+  TTTState starts[ttt::kLanes];
+  for (int lane = 0; lane < ttt::kLanes; lane++) {
+    starts[lane] = lane % 2 == 0 ? x_won : one_left;
+  }
+  starts[1] = x_to_win;
+  TTTState::Status outcomes[ttt::kLanes];
+  ttt::playBatch(starts, outcomes, rng);
+  for (int lane = 0; lane < ttt::kLanes; lane++) {
+    if (lane == 1) {
+      REQUIRE(outcomes[lane] != TTTState::Status::kOngoing);
+    } else if (lane % 2 == 0) {
+      REQUIRE(outcomes[lane] == TTTState::Status::kXWon);
+    } else {
+      REQUIRE(outcomes[lane] == TTTState::Status::kDraw);
+    }
+  }
+
+  // randomPlayouts leaves the game where it was.
+  game.setCurrentState(x_to_win);
+  const auto total = game.randomPlayouts(rng, 100);
+  REQUIRE(game.getCurrentState() == x_to_win);
+  REQUIRE(total.at(0) + total.at(1) == 0.0);
+  REQUIRE(std::abs(total.at(0)) <= 100.0);
+
+  // From a finished game nothing is played, one at a time or in batches.
+  game.setCurrentState(x_won);
+  for (int num_playouts : {1, ttt::kLanes / 2 - 1, ttt::kLanes / 2, 100}) {
+    const auto none = game.randomPlayouts(rng, num_playouts);
+    REQUIRE(none.at(0) == 0.0);
+    REQUIRE(none.at(1) == 0.0);
+  }
+  const ttt::PlayoutCounts no_counts = ttt::playOutcomes(x_won, 100, rng);
+  REQUIRE(no_counts.x_wins + no_counts.o_wins + no_counts.draws == 0);
+}
+
+TEST_CASE("UCT averages several playouts per leaf", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(3);
+  UCT<State, Action, TicTacToe>::RolloutConfig config;
+  config.playouts_per_leaf = 32;
+  for (int i = 0; i < 200; i++) {
+    uct.rollout(&game, &policy, config);
+  }
+  const auto &root = uct.getNode(TTTState());
+  REQUIRE(root.num_rollouts_involved == 200);
+  // Each rollout adds one visit, and an averaged reward of at most 1.
+  REQUIRE(std::abs(root.total_reward_from_here.at(0)) <= 200.0);
+  REQUIRE(root.total_reward_from_here.at(0) > 0.0);
+}
+
+TEST_CASE("UCT splits a leaf's playouts over threads", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(5);
+  UCT<State, Action, TicTacToe>::RolloutConfig config;
+  config.playouts_per_leaf = 64;
+  config.num_threads = 4;
+  for (int i = 0; i < 200; i++) {
+    uct.rollout(&game, &policy, config);
+  }
+  // The workers are reused across rollouts, and still contribute one averaged
+  // reward per rollout.
+  const auto &root = uct.getNode(TTTState());
+  REQUIRE(root.num_rollouts_involved == 200);
+  REQUIRE(std::abs(root.total_reward_from_here.at(0)) <= 200.0);
+  REQUIRE(root.total_reward_from_here.at(0) > 0.0);
+}
+
+TEST_CASE("Root parallel UCT merges the threads' trees", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(9);
+  uct.searchParallel(&game, &policy, /*num_rollouts=*/4001, /*num_threads=*/4);
+  const auto &root = uct.getNode(TTTState());
+  REQUIRE(root.num_rollouts_involved == 4001);
+  // Every rollout went through exactly one of the root's edges.
+  int edge_rollouts = 0;
+  for (int pos = 0; pos < 9; pos++) {
+    game.reset();
+    game.simulate(TTTAction(pos));
+    const auto *child = uct.findNode(game.getCurrentState());
+    REQUIRE(child != nullptr);
+    edge_rollouts += child->num_rollouts_involved;
+  }
+  REQUIRE(edge_rollouts == 4001);
+
+  // Merging a tree into an empty one copies its statistics.
+  UCT<State, Action, TicTacToe> copy;
+  copy.merge(uct);
+  // The empty tree had already counted its root, so it ends up with the same
+  // set of nodes.
+  REQUIRE(copy.numNodes() == uct.numNodes());
+  REQUIRE(copy.getNode(TTTState()).num_rollouts_involved == 4001);
+  game.reset();
+  REQUIRE(copy.actGreedily(&game).board_position ==
+          uct.actGreedily(&game).board_position);
+}
+
+TEST_CASE("Shared tree UCT counts every rollout once", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(4);
+  uct.searchShared(&game, &policy, /*num_rollouts=*/3000, /*num_threads=*/4);
+  const auto &root = uct.getNode(TTTState());
+  REQUIRE(root.num_rollouts_involved == 3000);
+  // Every virtual loss was taken back, so the root's children add up to the
+  // root, and rewards stay within one per visit.
+  int child_rollouts = 0;
+  double child_reward = 0.0;
+  for (int pos = 0; pos < 9; pos++) {
+    game.reset();
+    game.simulate(TTTAction(pos));
+    const auto *child = uct.findNode(game.getCurrentState());
+    REQUIRE(child != nullptr);
+    child_rollouts += child->num_rollouts_involved;
+    child_reward += child->total_reward_from_here.at(0);
+  }
+  REQUIRE(child_rollouts == 3000);
+  REQUIRE(child_reward == Approx(root.total_reward_from_here.at(0)));
+  REQUIRE(std::abs(root.total_reward_from_here.at(0)) <= 3000.0);
+
+  // Playing greedily from a tree grown this way beats a random opponent. How
+  // threads interleave changes the tree, so grow this one on a single thread
+  // to get the same games every run.
+  UCT<State, Action, TicTacToe> serial;
+  RandomValidPolicy<State, Action> serial_policy(4);
+  serial.searchShared(&game, &serial_policy, /*num_rollouts=*/3000,
+                      /*num_threads=*/1);
+  RandomValidPolicy<State, Action> opponent(5);
+  int losses = 0;
+  for (int i = 0; i < 50; i++) {
+    game.reset();
+    while (!game.isTerminal()) {
+      const Action action = game.turn() == 0 ? serial.actGreedily(&game)
+                                             : opponent.act(&game);
+      if (game.simulate(action).at(0) < 0) {
+        losses++;
+      }
+    }
+  }
+  REQUIRE(losses <= 5);
+}
+
+TEST_CASE("UCT search stops at its budget", "[uct]") {
+  using TTTUCT = UCT<State, Action, TicTacToe>;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(6);
+
+  TTTUCT::SearchBudget rollout_budget;
+  rollout_budget.max_rollouts = 500;
+  TTTUCT uct;
+  TTTUCT::SearchResult result = uct.search(&game, &policy, rollout_budget);
+  REQUIRE(result.num_rollouts == 500);
+  REQUIRE(uct.getNode(TTTState()).num_rollouts_involved == 500);
+  REQUIRE(result.num_nodes_created == uct.numNodes() - 1);
+  REQUIRE(result.best_action.has_value());
+
+  // The node limit covers the whole tree, including what is already there.
+  TTTUCT::SearchBudget node_budget;
+  const size_t start_nodes = uct.numNodes();
+  node_budget.max_nodes = start_nodes + 100;
+  result = uct.search(&game, &policy, node_budget);
+  // A rollout can add two nodes, so the last one may go one over.
+  REQUIRE(uct.numNodes() >= start_nodes + 100);
+  REQUIRE(uct.numNodes() <= start_nodes + 101);
+  REQUIRE(result.num_nodes_created == uct.numNodes() - start_nodes);
+
+  // A deadline that has passed stops the search before it starts.
+  TTTUCT fresh;
+  result = fresh.search(&game, &policy,
+                        TTTUCT::SearchBudget::forDuration(
+                            std::chrono::steady_clock::duration::zero()));
+  REQUIRE(result.num_rollouts == 0);
+
+  result = fresh.search(
+      &game, &policy,
+      TTTUCT::SearchBudget::forDuration(std::chrono::milliseconds(20)));
+  REQUIRE(result.num_rollouts > 0);
+  REQUIRE(result.elapsed >= std::chrono::milliseconds(20));
+  REQUIRE(result.elapsed < std::chrono::seconds(2));
+
+  // With several threads, the rollout limit is still exact.
+  TTTUCT shared;
+  result = shared.search(&game, &policy, rollout_budget, /*num_threads=*/4);
+  REQUIRE(result.num_rollouts == 500);
+  REQUIRE(shared.getNode(TTTState()).num_rollouts_involved == 500);
+  node_budget.max_nodes = shared.numNodes() + 100;
+  result = shared.search(&game, &policy, node_budget, /*num_threads=*/4);
+  REQUIRE(shared.numNodes() >= node_budget.max_nodes);
+  REQUIRE(shared.numNodes() <= node_budget.max_nodes + 1);
+}
+
+TEST_CASE("UCT rerooting keeps the subtree", "[uct]") {
+  using TTTUCT = UCT<State, Action, TicTacToe>;
+  TTTUCT uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(7);
+  for (int i = 0; i < 2000; i++) {
+    uct.rollout(&game, &policy);
+  }
+  const size_t num_nodes = uct.numNodes();
+  game.simulate(Action(4));
+  const State after_move = game.getCurrentState();
+  const TTTUCT::Node before = uct.getNode(after_move);
+  REQUIRE(before.num_rollouts_involved > 0);
+
+  uct.reroot(after_move);
+  REQUIRE(uct.rootState().hash == after_move.hash);
+  REQUIRE(uct.findNode(State()) == nullptr);
+  REQUIRE(uct.numNodes() < num_nodes);
+  const TTTUCT::Node &kept = uct.getNode(after_move);
+  REQUIRE(kept.num_rollouts_involved == before.num_rollouts_involved);
+  REQUIRE(kept.total_reward_from_here.at(0) ==
+          before.total_reward_from_here.at(0));
+  REQUIRE(kept.num_tried == before.num_tried);
+
+  // Rollouts now start from the new root and leave the game there.
+  game.reset();
+  for (int i = 0; i < 100; i++) {
+    uct.rollout(&game, &policy);
+  }
+  REQUIRE(game.getCurrentState().hash == after_move.hash);
+  REQUIRE(uct.getNode(after_move).num_rollouts_involved ==
+          before.num_rollouts_involved + 100);
+
+  // search reroots at the game's position.
+  game.simulate(Action(0));
+  TTTUCT::SearchBudget budget;
+  budget.max_rollouts = 200;
+  const TTTUCT::SearchResult result = uct.search(&game, &policy, budget);
+  REQUIRE(uct.rootState().hash == game.getCurrentState().hash);
+  REQUIRE(uct.getNode(game.getCurrentState()).num_rollouts_involved >= 200);
+  REQUIRE(result.best_action.has_value());
+}
+
+TEST_CASE("UCT searching every move beats a random player", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(8);
+  RandomValidPolicy<State, Action> opponent(9);
+  int losses = 0;
+  for (int i = 0; i < 10; i++) {
+    const double reward = uct.playSearching(
+        &game, &opponent, /*opponent_goes_first=*/i % 2 == 1, &policy,
+        std::chrono::milliseconds(5));
+    losses += reward < 0;
+  }
+  REQUIRE(losses <= 2);
+}
+
+TEST_CASE("UCT ponders while the opponent thinks", "[uct]") {
+  UCT<State, Action, TicTacToe> uct;
+  TicTacToe game;
+  RandomValidPolicy<State, Action> policy(10);
+  game.simulate(Action(4));
+  uct.startPondering(&game, &policy);
+  REQUIRE(uct.isPondering());
+  // The game is cloned, so it can be played on meanwhile.
+  game.simulate(Action(0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  const int pondered = uct.stopPondering();
+  REQUIRE(!uct.isPondering());
+  REQUIRE(pondered > 0);
+  game.reset();
+  game.simulate(Action(4));
+  REQUIRE(uct.rootState().hash == game.getCurrentState().hash);
+  REQUIRE(uct.getNode(game.getCurrentState()).num_rollouts_involved ==
+          pondered);
+
+  // Pondering stops at the node limit. The tree can't be looked at until
+  // pondering has stopped.
+  const size_t max_nodes = uct.numNodes() + 100;
+  uct.startPondering(&game, &policy, /*num_threads=*/1, max_nodes);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE(uct.stopPondering() > 0);
+  REQUIRE(uct.numNodes() <= max_nodes + 1);
+
+  RandomValidPolicy<State, Action> opponent(11);
+  const double reward = uct.playSearching(
+      &game, &opponent, /*opponent_goes_first=*/true, &policy,
+      std::chrono::milliseconds(2), /*num_threads=*/1, /*verbose=*/false,
+      /*ponder=*/true);
+  REQUIRE(!uct.isPondering());
+  REQUIRE(std::abs(reward) <= 1.0);
+}
+
+TEST_CASE("UCT proves wins, losses and draws", "[uct]") {
+  using TTTUCT = UCT<State, Action, TicTacToe>;
+  using Proof = TTTUCT::Proof;
+  RandomValidPolicy<State, Action> policy(12);
+  TTTUCT::SearchBudget budget;
+  budget.max_rollouts = 1000000;
+  TTTUCT::RolloutConfig config;
+  config.solve = true;
+
+  // x, x, 2
+  // o, o, 5
+  // 6, 7, 8
+  // X to move wins at 2, and search stops as soon as that is proven.
+  TicTacToe game;
+  for (int pos : {0, 3, 1, 4}) {
+    game.simulate(Action(pos));
+  }
+  TTTUCT uct;
+  TTTUCT::SearchResult result =
+      uct.search(&game, &policy, budget, /*num_threads=*/1, config);
+  REQUIRE(result.root_proof == Proof::kWin);
+  REQUIRE(result.best_action->board_position == 2);
+  REQUIRE(result.num_rollouts < 100);
+
+  // x, x, 2
+  // 3, o, 5
+  // 6, 7, 8
+  // O has to block at 2. The other moves are proven to lose and aren't
+  // visited again.
+  game.reset();
+  for (int pos : {0, 4, 1}) {
+    game.simulate(Action(pos));
+  }
+  TTTUCT blocker;
+  budget.max_rollouts = 2000;
+  result = blocker.search(&game, &policy, budget, /*num_threads=*/1, config);
+  REQUIRE(result.best_action->board_position == 2);
+  const std::vector<int> losing_moves = {3, 5, 6, 7, 8};
+  std::vector<int> losing_visits;
+  for (int pos : losing_moves) {
+    game.simulate(Action(pos));
+    const TTTUCT::Node &losing = blocker.getNode(game.getCurrentState());
+    REQUIRE(losing.proof == Proof::kLoss);
+    losing_visits.push_back(losing.num_rollouts_involved);
+    game.setCurrentState(blocker.rootState());
+  }
+  result = blocker.search(&game, &policy, budget, /*num_threads=*/1, config);
+  for (int i = 0; i < (int)losing_moves.size(); i++) {
+    game.simulate(Action(losing_moves[i]));
+    REQUIRE(blocker.getNode(game.getCurrentState()).num_rollouts_involved ==
+            losing_visits[i]);
+    game.setCurrentState(blocker.rootState());
+  }
+
+  // The whole game is solved as a draw well before the budget runs out,
+  // whatever the playouts draw.
+  game.reset();
+  budget.max_rollouts = 1000000;
+  for (uint64_t seed = 0; seed < 10; seed++) {
+    TTTUCT seeded_solver;
+    RandomValidPolicy<State, Action> seeded_policy(seed);
+    result = seeded_solver.search(&game, &seeded_policy, budget,
+                                  /*num_threads=*/1, config);
+    REQUIRE(result.root_proof == Proof::kDraw);
+    REQUIRE(result.num_rollouts < 100000);
+  }
+  TTTUCT solver;
+  result = solver.search(&game, &policy, budget, /*num_threads=*/1, config);
+  REQUIRE(result.root_proof == Proof::kDraw);
+  // Searching a solved root does nothing.
+  REQUIRE(solver.search(&game, &policy, budget, /*num_threads=*/1, config)
+              .num_rollouts == 0);
+
+  // Solving is off by default, so nothing is proven and the whole budget is
+  // spent.
+  TTTUCT unsolved;
+  budget.max_rollouts = 200;
+  result = unsolved.search(&game, &policy, budget);
+  REQUIRE(result.root_proof == Proof::kUnknown);
+  REQUIRE(result.num_rollouts == 200);
+}
+
+TEST_CASE("UCT only creates nodes for children it plays", "[uct]") {
+  UCT<State, Action> uct;
+  std::unique_ptr<Game<State, Action>> game = std::make_unique<TicTacToe>();
+  auto simulation_policy = std::make_unique<RandomValidPolicy<State, Action>>();
+
+  // The first rollout adds the child it simulates from. Every later one adds
+  // the untried opening move it selects plus the reply it simulates from,
+  // rather than all of the root's and that child's children.
+  for (size_t i = 1; i <= 9; i++) {
+    uct.rollout(game.get(), simulation_policy.get());
+    REQUIRE(uct.numNodes() == 2 * i);
+  }
+  // By now every opening move has been tried once.
+  const auto *root = uct.findNode(State());
+  REQUIRE(root->num_rollouts_involved == 9);
+  for (int pos = 0; pos < 9; pos++) {
+    const auto *child =
+        uct.findNode(game->simulateDry(State(), Action(pos)).first);
+    REQUIRE(child != nullptr);
+    REQUIRE(child->num_rollouts_involved == 1);
+  }
+}
+
+TEST_CASE("Tic-tac-toe detects wins and draws", "[tic-tac-toe]") {
+  TicTacToe game;
+  auto play = [&](const std::vector<int> &moves) {
+    game.reset();
+    RewardMap<2> reward = TwoPlayerNobodyWinsReward;
+    for (int pos : moves) {
+      REQUIRE_FALSE(game.isTerminal());
+      reward = game.simulate(Action(pos));
+    }
+    return reward;
+  };
+
+  // x takes the middle column.
+  REQUIRE(play({1, 0, 4, 2, 7}).at(0) == Approx(1.0));
+  REQUIRE(game.isTerminal());
+  REQUIRE(game.getCurrentState().status == TTTState::Status::kXWon);
+  REQUIRE(game.getCurrentState().at(4) == 'x');
+  REQUIRE(game.getCurrentState().at(0) == 'o');
+  REQUIRE(game.getCurrentState().at(3) == '_');
+
+  // o takes the anti-diagonal.
+  REQUIRE(play({0, 2, 1, 4, 8, 6}).at(1) == Approx(1.0));
+  REQUIRE(game.isTerminal());
+  REQUIRE(game.getCurrentState().status == TTTState::Status::kOWon);
+
+  // Full board with no line is a draw.
+  REQUIRE(play({0, 1, 2, 4, 3, 5, 7, 6, 8}).at(0) == Approx(0.0));
+  REQUIRE(game.isTerminal());
+  REQUIRE(game.getCurrentState().status == TTTState::Status::kDraw);
+  REQUIRE(game.getValidActions().empty());
+
+  // x completes a line with the last free square: a win, not a draw.
+  REQUIRE(play({0, 1, 2, 3, 4, 5, 7, 6, 8}).at(0) == Approx(1.0));
+  REQUIRE(game.getCurrentState().status == TTTState::Status::kXWon);
+
+  // Unfinished game.
+  play({0, 4});
+  REQUIRE_FALSE(game.isTerminal());
+  REQUIRE(game.getValidActions().size() == 7);
+  // The allocation-free overload lists the same actions in the same order.
+  Game<State, Action>::ActionList action_list;
+  game.getValidActions(action_list);
+  const std::vector<Action> action_vector = game.getValidActions();
+  REQUIRE((size_t)action_list.size() == action_vector.size());
+  for (size_t i = 0; i < action_vector.size(); i++) {
+    REQUIRE(action_list[i].board_position == action_vector[i].board_position);
+  }
+  REQUIRE(game.render().find("x,1,2") != std::string::npos);
+}
+
 TEST_CASE("First rollout backprop is working", "[uct]") {
   std::cout << "----------------TESTING UCT ----------------------"
             << std::endl;
@@ -172,17 +1034,35 @@ TEST_CASE("First rollout backprop is working", "[uct]") {
   auto rollout_history =
       uct.rollout(game.get(), simulation_policy.get(), /*verbose=*/true);
 
-  // get the nodes for introspection
-  const auto &nodes = uct.getNodes();
+  // Root and the expanded child.
+  REQUIRE(uct.numNodes() == 2);
+  REQUIRE(uct.findNode(State())->num_rollouts_involved == 1);
 
-  // Let's roll it out again?
+  // Let's roll it out again? Selection tries the next untried opening move,
+  // x at 1, and the simulation starts from o's reply.
+  //
+  //  o2, x1,
+  //  o4, x3,
+  //    , x5,
   {
-    std::vector<Action> moves = {Action(0), Action(5), Action(4), Action(8),
-                                 Action(2), Action(6), Action(1)};
+    std::vector<Action> moves = {Action(0), Action(4), Action(3), Action(7)};
     std::unique_ptr<Policy<State, Action>> simulation_policy =
         std::make_unique<HardCodedPolicy<State, Action>>(std::move(moves));
 
     auto rollout_history =
         uct.rollout(game.get(), simulation_policy.get(), /*verbose=*/true);
   }
+
+  // The selected child and the one simulated from were added, and x's win
+  // was backed up through both.
+  REQUIRE(uct.numNodes() == 4);
+  const auto *root = uct.findNode(State());
+  REQUIRE(root->num_rollouts_involved == 2);
+  REQUIRE(root->total_reward_from_here.at(0) == 2.0);
+  game->reset();
+  game->simulate(Action(1));
+  const auto *child = uct.findNode(game->getCurrentState());
+  REQUIRE(child != nullptr);
+  REQUIRE(child->num_rollouts_involved == 1);
+  REQUIRE(child->total_reward_from_here.at(0) == 1.0);
 }
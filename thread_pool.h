@@ -0,0 +1,245 @@
+#ifndef MCTS_THREAD_POOL
+#define MCTS_THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+// Work-stealing thread pool that every parallel search and evaluation runs its
+// tasks on, so that mixing them never starts more threads than there are
+// cores.
+//
+// Each worker has its own deque. A task submitted from a worker goes on the
+// back of that worker's deque, and the worker takes its next task from the
+// back too, so nested tasks run depth first while their inputs are still in
+// cache. Tasks submitted from outside the pool go on a shared queue. A worker
+// with nothing to do takes from the shared queue, and then steals from the
+// front of the other workers' deques, where the oldest and usually largest
+// tasks are.
+//
+// Tasks are run through a TaskGroup, which is waited on as a whole. A thread
+// waiting on a group runs queued tasks in the meantime instead of blocking, so
+// tasks can wait on nested groups without deadlocking the pool, and a thread
+// outside the pool that waits counts as one more worker. That is why global()
+// starts one worker fewer than there are cores.
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_workers) : queues_(num_workers) {
+    assert(num_workers >= 0);
+    for (int w = 0; w < num_workers; w++) {
+      queues_[w] = std::make_unique<Queue>();
+    }
+    for (int w = 0; w < num_workers; w++) {
+      workers_.emplace_back([this, w]() { work(w); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // The pool shared by the whole process, with a worker for every core but
+  // the one of the thread waiting on the work.
+  static ThreadPool &global() {
+    static ThreadPool pool(
+        std::max(1, (int)std::thread::hardware_concurrency()) - 1);
+    return pool;
+  }
+
+  int numWorkers() const { return workers_.size(); }
+
+  // Threads that can run tasks at once: the workers and one waiting thread.
+  int concurrency() const { return numWorkers() + 1; }
+
+private:
+  friend class TaskGroup;
+
+  struct Task {
+    std::function<void()> run;
+    TaskGroup *group;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void submit(Task task) {
+    const int w = currentWorker();
+    Queue &queue = w >= 0 ? *queues_[w] : shared_queue_;
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      num_queued_++;
+    }
+    wake_.notify_one();
+  }
+
+  // Takes a task for the current thread: its own newest task if it is a
+  // worker, else the oldest shared task, else the oldest task of another
+  // worker.
+  bool take(Task &task) {
+    const int self = currentWorker();
+    if (self >= 0 && popBack(*queues_[self], task)) {
+      return true;
+    }
+    if (popFront(shared_queue_, task)) {
+      return true;
+    }
+    const int num_queues = queues_.size();
+    for (int i = 1; i <= num_queues; i++) {
+      const int victim = (std::max(self, 0) + i) % num_queues;
+      if (victim != self && popFront(*queues_[victim], task)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool popBack(Queue &queue, Task &task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    taken();
+    return true;
+  }
+
+  bool popFront(Queue &queue, Task &task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    taken();
+    return true;
+  }
+
+  void taken() {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    num_queued_--;
+  }
+
+  // Runs one queued task, if there is one.
+  inline bool runOne();
+
+  void work(int w) {
+    current_pool_ = this;
+    current_worker_ = w;
+    while (true) {
+      if (runOne()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      wake_.wait(lock, [this]() { return stopping_ || num_queued_ > 0; });
+      if (stopping_) {
+        return;
+      }
+    }
+  }
+
+  // The current thread's index in this pool, or -1 if it isn't one of this
+  // pool's workers.
+  int currentWorker() const {
+    return current_pool_ == this ? current_worker_ : -1;
+  }
+
+  static inline thread_local const ThreadPool *current_pool_ = nullptr;
+  static inline thread_local int current_worker_ = -1;
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  Queue shared_queue_;
+  std::vector<std::thread> workers_;
+
+  // Idle workers sleep until a task is queued.
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  int num_queued_ = 0;
+  bool stopping_ = false;
+};
+
+// A set of tasks run on a ThreadPool and waited for together.
+//
+// Cancelling a group skips its tasks that haven't started yet. Tasks already
+// running can check cancelled() to stop early. Tasks shouldn't throw.
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool &pool = ThreadPool::global()) : pool_(pool) {}
+
+  // Waits for the tasks still running, since they may refer to the caller's
+  // locals.
+  ~TaskGroup() { wait(); }
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  ThreadPool &pool() const { return pool_; }
+
+  void run(std::function<void()> task) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    pool_.submit({std::move(task), this});
+  }
+
+  // Returns once every task of the group has finished or been skipped,
+  // running queued tasks of any group until then.
+  void wait() {
+    while (pending_.load(std::memory_order_acquire) > 0) {
+      if (!pool_.runOne()) {
+        // Our remaining tasks are running on other threads.
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+private:
+  friend class ThreadPool;
+
+  void finish() { pending_.fetch_sub(1, std::memory_order_release); }
+
+  ThreadPool &pool_;
+  std::atomic<int> pending_{0};
+  std::atomic<bool> cancelled_{false};
+};
+
+inline bool ThreadPool::runOne() {
+  Task task;
+  if (!take(task)) {
+    return false;
+  }
+  if (!task.group->cancelled()) {
+    task.run();
+  }
+  task.group->finish();
+  return true;
+}
+
+#endif // MCTS_THREAD_POOL
@@ -2,46 +2,18 @@
 #include "matplotlibcpp.h"
 #include "mcts.h"
 #include "tic-tac-toe.h"
+#include "utils.h"
 
 typedef TTTState State;
 typedef TTTAction Action;
-
-// Returns win/loss/draw percentage
-std::array<double, 3> evaluateAgainstRandomOpponent(MCTS<State, Action> *mcts,
-                                                    Game<State, Action> *game,
-                                                    bool opponent_goes_first) {
-  auto opponent_policy = std::make_unique<RandomValidPolicy<State, Action>>();
-
-  const int num_runs = 300;
-  int num_wins = 0;
-  int num_losses = 0;
-  int num_draws = 0;
-
-  for (int i = 0; i < num_runs; i++) {
-    // Infer game type from reward.
-    double final_reward = mcts->evaluate(game, opponent_policy.get(),
-                                         opponent_goes_first, /*verbose=*/false)
-                              .back()
-                              .reward;
-    if (final_reward == 1.0) {
-      num_wins++;
-    } else if (final_reward == 0.0) {
-      num_draws++;
-    } else {
-      assert(final_reward == -1.0);
-      num_losses++;
-    }
-  }
-  return {(double)num_wins / num_runs, (double)num_losses / num_runs,
-          (double)num_draws / num_runs};
-}
+typedef MCTS<State, Action, TicTacToe> TTTMCTS;
 
 namespace plt = matplotlibcpp;
 
 void train_test_plot(EpsilonScheduler *sched, bool opponent_goes_first,
                      bool interactive) {
-  std::unique_ptr<Game<State, Action>> game = std::make_unique<TicTacToe>();
-  MCTS<State, Action> mcts;
+  std::unique_ptr<TicTacToe> game = std::make_unique<TicTacToe>();
+  TTTMCTS mcts;
 
   // Plot winning percentage over number of training rollouts
   std::vector<double> xs;
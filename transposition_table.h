@@ -0,0 +1,231 @@
+#ifndef MCTS_TRANSPOSITION_TABLE
+#define MCTS_TRANSPOSITION_TABLE
+
+#include "atomic_ops.h"
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash table keyed by a 64-bit state hash. The search trees use
+// it as their node store instead of std::map<State, Node>, so finding a node is
+// a short linear probe over one flat array rather than a red-black tree walk.
+//
+// Two states with the same 64-bit key are treated as the same state, so keys
+// should come from a good hash of the whole state.
+//
+// findShared and findOrInsertShared can be called from several threads at
+// once. They can't rehash, so findOrInsertShared fails once the table is as
+// full as it is allowed to get, and callers should reserve() room for every
+// insertion beforehand. The other methods are single-threaded.
+template <class Value> class TranspositionTable {
+public:
+  explicit TranspositionTable(size_t initial_capacity = 1024) {
+    slots_.resize(roundUpToPowerOfTwo(initial_capacity));
+  }
+
+  // Returns the value stored for key, or nullptr if there is none. The pointer
+  // is invalidated by the next insertion.
+  Value *find(uint64_t key) {
+    const uint64_t slot_key = toSlotKey(key);
+    for (size_t i = bucket(slot_key);; i = (i + 1) & mask()) {
+      Slot &slot = slots_[i];
+      if (slot.key == slot_key) {
+        return &slot.value;
+      }
+      if (slot.key == kEmptyKey) {
+        return nullptr;
+      }
+    }
+  }
+
+  const Value *find(uint64_t key) const {
+    return const_cast<TranspositionTable *>(this)->find(key);
+  }
+
+  // Looks up key, inserting a default constructed value if it isn't there yet.
+  // Only one probe sequence is walked either way. Returns the stored value and
+  // whether it was just inserted. The reference is invalidated by the next
+  // insertion.
+  std::pair<Value &, bool> findOrInsert(uint64_t key) {
+    // Grow up front so the probe below can insert wherever it stops.
+    if ((size_ + 1) * kMaxLoadDenominator > slots_.size() * kMaxLoadNumerator) {
+      rehash(slots_.size() * 2);
+    }
+    const uint64_t slot_key = toSlotKey(key);
+    for (size_t i = bucket(slot_key);; i = (i + 1) & mask()) {
+      Slot &slot = slots_[i];
+      if (slot.key == slot_key) {
+        return {slot.value, false};
+      }
+      if (slot.key == kEmptyKey) {
+        slot.key = slot_key;
+        slot.value = Value();
+        slot.published = true;
+        size_++;
+        return {slot.value, true};
+      }
+    }
+  }
+
+  // Like find, but safe alongside findOrInsertShared on other threads. Returns
+  // a copy of the value rather than a pointer, since other threads may be
+  // writing next to it.
+  bool findShared(uint64_t key, Value *value) const {
+    const uint64_t slot_key = toSlotKey(key);
+    for (size_t i = bucket(slot_key);; i = (i + 1) & mask()) {
+      const Slot &slot = slots_[i];
+      const uint64_t current = atomicLoad(slot.key, __ATOMIC_ACQUIRE);
+      if (current == slot_key) {
+        *value = waitForValue(slot);
+        return true;
+      }
+      if (current == kEmptyKey) {
+        return false;
+      }
+    }
+  }
+
+  // Looks up key, inserting value if it isn't there yet, and returns the value
+  // stored and whether it was just inserted. Safe to call from several threads
+  // at once: a thread claims an empty slot by compare-and-swapping its key in,
+  // and other threads looking up the same key wait for the value to follow.
+  //
+  // Returns nullopt if key isn't there and the table is too full to insert
+  // it. Room is counted before a slot is claimed, so the table never fills up
+  // and probes always end at an empty slot.
+  std::optional<std::pair<Value, bool>> findOrInsertShared(uint64_t key,
+                                                           const Value &value) {
+    const uint64_t slot_key = toSlotKey(key);
+    const size_t max_size = maxSize();
+    for (size_t i = bucket(slot_key);; i = (i + 1) & mask()) {
+      Slot &slot = slots_[i];
+      uint64_t current = atomicLoad(slot.key, __ATOMIC_ACQUIRE);
+      if (current == kEmptyKey) {
+        size_t size;
+        if (!atomicFetchAddUpTo(size_, (size_t)1, max_size, &size)) {
+          return std::nullopt;
+        }
+        if (atomicCompareExchange(slot.key, current, slot_key)) {
+          slot.value = value;
+          atomicStore(slot.published, true, __ATOMIC_RELEASE);
+          return std::make_pair(value, true);
+        }
+        // Another thread took the slot. current is now its key. Give back the
+        // room counted for it.
+        atomicFetchAdd(size_, ~(size_t)0);
+      }
+      if (current == slot_key) {
+        return std::make_pair(waitForValue(slot), false);
+      }
+    }
+  }
+
+  // Makes room for n entries without further rehashing.
+  void reserve(size_t n) {
+    const size_t needed =
+        roundUpToPowerOfTwo(n * kMaxLoadDenominator / kMaxLoadNumerator + 1);
+    if (needed > slots_.size()) {
+      rehash(needed);
+    }
+  }
+
+  // Drops every entry but keeps the allocated slots.
+  void clear() {
+    for (Slot &slot : slots_) {
+      slot = Slot();
+    }
+    size_ = 0;
+  }
+
+  size_t size() const { return atomicLoad(size_); }
+  size_t capacity() const { return slots_.size(); }
+  // Most entries the table holds without rehashing, and so the most that
+  // findOrInsertShared can insert.
+  size_t maxSize() const {
+    return slots_.size() * kMaxLoadNumerator / kMaxLoadDenominator;
+  }
+
+  // Calls fn(value) on every stored value, in no particular order.
+  template <class Fn> void forEach(Fn fn) const {
+    for (const Slot &slot : slots_) {
+      if (slot.key != kEmptyKey) {
+        fn(slot.value);
+      }
+    }
+  }
+
+private:
+  // A zero key marks an empty slot, so a real key of zero is stored as
+  // kZeroKeyStandIn instead.
+  static constexpr uint64_t kEmptyKey = 0;
+  static constexpr uint64_t kZeroKeyStandIn = 0x9e3779b97f4a7c15ULL;
+  // Grow once the table is more than half full.
+  static constexpr size_t kMaxLoadNumerator = 1;
+  static constexpr size_t kMaxLoadDenominator = 2;
+
+  struct Slot {
+    uint64_t key = kEmptyKey;
+    Value value = Value();
+    // Set once value has been written, for the shared methods. Fits in the
+    // padding after small values.
+    bool published = false;
+  };
+
+  // The value in slot, once the thread that inserted it has written it.
+  static Value waitForValue(const Slot &slot) {
+    while (!atomicLoad(slot.published, __ATOMIC_ACQUIRE)) {
+      std::this_thread::yield();
+    }
+    return slot.value;
+  }
+
+  static uint64_t toSlotKey(uint64_t key) {
+    return key == kEmptyKey ? kZeroKeyStandIn : key;
+  }
+
+  static size_t roundUpToPowerOfTwo(size_t n) {
+    size_t capacity = 16;
+    while (capacity < n) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  size_t mask() const { return slots_.size() - 1; }
+
+  // Keys may be structured (e.g. a board encoding), so mix the bits before
+  // picking a bucket. This is the splitmix64 finalizer.
+  size_t bucket(uint64_t key) const {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key & mask();
+  }
+
+  void rehash(size_t new_capacity) {
+    assert((new_capacity & (new_capacity - 1)) == 0);
+    std::vector<Slot> old_slots(new_capacity);
+    old_slots.swap(slots_);
+    for (Slot &old_slot : old_slots) {
+      if (old_slot.key == kEmptyKey) {
+        continue;
+      }
+      size_t i = bucket(old_slot.key);
+      while (slots_[i].key != kEmptyKey) {
+        i = (i + 1) & mask();
+      }
+      slots_[i] = std::move(old_slot);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+#endif // MCTS_TRANSPOSITION_TABLE
@@ -0,0 +1,186 @@
+#ifndef MCTS_UCB
+#define MCTS_UCB
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// UCB1 selection over a node's children, stored as parallel arrays of visit
+// counts and total rewards (from the point of view of the player choosing).
+//
+// Returns the index of the first child with zero visits if there is one, and
+// otherwise the index of the child maximizing
+//
+//   total_reward[i] / visits[i] + c * sqrt(log_parent_visits / visits[i])
+//
+// with ties going to the lowest index. log_parent_visits is taken as an
+// argument so the log is computed once per node rather than once per child.
+//
+// Uses AVX2 (4 children at a time) or SSE2 (2 at a time) when compiled with
+// them, e.g. with -march=native, and falls back to scalar code otherwise. All
+// paths return the same index.
+
+inline int selectUcbScalar(const int32_t *visits, const double *total_reward,
+                           int num_children, double log_parent_visits,
+                           double c) {
+  int best_idx = -1;
+  double best_ucb = std::numeric_limits<double>::lowest();
+  for (int i = 0; i < num_children; i++) {
+    if (visits[i] == 0) {
+      return i;
+    }
+    const double n = (double)visits[i];
+    const double ucb =
+        total_reward[i] / n + c * std::sqrt(log_parent_visits / n);
+    if (ucb > best_ucb) {
+      best_ucb = ucb;
+      best_idx = i;
+    }
+  }
+  return best_idx;
+}
+
+#if defined(__AVX2__)
+
+inline int selectUcb(const int32_t *visits, const double *total_reward,
+                     int num_children, double log_parent_visits, double c) {
+  const __m256d log_n = _mm256_set1_pd(log_parent_visits);
+  const __m256d c_vec = _mm256_set1_pd(c);
+  // Each lane keeps the best score (and its index) among the children it has
+  // seen, so a later child only wins a lane with a strictly higher score.
+  __m256d best_ucb = _mm256_set1_pd(std::numeric_limits<double>::lowest());
+  __m256d best_idx = _mm256_set1_pd(-1.0);
+  __m256d idx = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+  const __m256d step = _mm256_set1_pd(4.0);
+
+  int i = 0;
+  for (; i + 4 <= num_children; i += 4) {
+    const __m256d n = _mm256_cvtepi32_pd(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(visits + i)));
+    const int unvisited =
+        _mm256_movemask_pd(_mm256_cmp_pd(n, _mm256_setzero_pd(), _CMP_EQ_OQ));
+    if (unvisited != 0) {
+      return i + __builtin_ctz(unvisited);
+    }
+    const __m256d exploit = _mm256_div_pd(_mm256_loadu_pd(total_reward + i), n);
+    const __m256d explore =
+        _mm256_mul_pd(c_vec, _mm256_sqrt_pd(_mm256_div_pd(log_n, n)));
+    const __m256d ucb = _mm256_add_pd(exploit, explore);
+    const __m256d better = _mm256_cmp_pd(ucb, best_ucb, _CMP_GT_OQ);
+    best_ucb = _mm256_blendv_pd(best_ucb, ucb, better);
+    best_idx = _mm256_blendv_pd(best_idx, idx, better);
+    idx = _mm256_add_pd(idx, step);
+  }
+
+  alignas(32) double lane_ucb[4];
+  alignas(32) double lane_idx[4];
+  _mm256_store_pd(lane_ucb, best_ucb);
+  _mm256_store_pd(lane_idx, best_idx);
+  double best = std::numeric_limits<double>::lowest();
+  int best_i = -1;
+  for (int lane = 0; lane < 4; lane++) {
+    const int lane_i = (int)lane_idx[lane];
+    if (lane_i < 0) {
+      continue;
+    }
+    if (lane_ucb[lane] > best || (lane_ucb[lane] == best && lane_i < best_i)) {
+      best = lane_ucb[lane];
+      best_i = lane_i;
+    }
+  }
+
+  // Remainder, at most 3 children.
+  for (; i < num_children; i++) {
+    if (visits[i] == 0) {
+      return i;
+    }
+    const double n = (double)visits[i];
+    const double ucb =
+        total_reward[i] / n + c * std::sqrt(log_parent_visits / n);
+    if (ucb > best) {
+      best = ucb;
+      best_i = i;
+    }
+  }
+  return best_i;
+}
+
+#elif defined(__SSE2__)
+
+inline int selectUcb(const int32_t *visits, const double *total_reward,
+                     int num_children, double log_parent_visits, double c) {
+  const __m128d log_n = _mm_set1_pd(log_parent_visits);
+  const __m128d c_vec = _mm_set1_pd(c);
+  __m128d best_ucb = _mm_set1_pd(std::numeric_limits<double>::lowest());
+  __m128d best_idx = _mm_set1_pd(-1.0);
+  __m128d idx = _mm_setr_pd(0.0, 1.0);
+  const __m128d step = _mm_set1_pd(2.0);
+
+  int i = 0;
+  for (; i + 2 <= num_children; i += 2) {
+    const __m128d n = _mm_cvtepi32_pd(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(visits + i)));
+    const int unvisited = _mm_movemask_pd(_mm_cmpeq_pd(n, _mm_setzero_pd()));
+    if (unvisited != 0) {
+      return i + __builtin_ctz(unvisited);
+    }
+    const __m128d exploit = _mm_div_pd(_mm_loadu_pd(total_reward + i), n);
+    const __m128d explore = _mm_mul_pd(c_vec, _mm_sqrt_pd(_mm_div_pd(log_n, n)));
+    const __m128d ucb = _mm_add_pd(exploit, explore);
+    // No blendv in SSE2, so select with and/andnot/or.
+    const __m128d better = _mm_cmpgt_pd(ucb, best_ucb);
+    best_ucb =
+        _mm_or_pd(_mm_and_pd(better, ucb), _mm_andnot_pd(better, best_ucb));
+    best_idx =
+        _mm_or_pd(_mm_and_pd(better, idx), _mm_andnot_pd(better, best_idx));
+    idx = _mm_add_pd(idx, step);
+  }
+
+  alignas(16) double lane_ucb[2];
+  alignas(16) double lane_idx[2];
+  _mm_store_pd(lane_ucb, best_ucb);
+  _mm_store_pd(lane_idx, best_idx);
+  double best = std::numeric_limits<double>::lowest();
+  int best_i = -1;
+  for (int lane = 0; lane < 2; lane++) {
+    const int lane_i = (int)lane_idx[lane];
+    if (lane_i < 0) {
+      continue;
+    }
+    if (lane_ucb[lane] > best || (lane_ucb[lane] == best && lane_i < best_i)) {
+      best = lane_ucb[lane];
+      best_i = lane_i;
+    }
+  }
+
+  // Remainder, at most 1 child.
+  for (; i < num_children; i++) {
+    if (visits[i] == 0) {
+      return i;
+    }
+    const double n = (double)visits[i];
+    const double ucb =
+        total_reward[i] / n + c * std::sqrt(log_parent_visits / n);
+    if (ucb > best) {
+      best = ucb;
+      best_i = i;
+    }
+  }
+  return best_i;
+}
+
+#else
+
+inline int selectUcb(const int32_t *visits, const double *total_reward,
+                     int num_children, double log_parent_visits, double c) {
+  return selectUcbScalar(visits, total_reward, num_children, log_parent_visits,
+                         c);
+}
+
+#endif
+
+#endif // MCTS_UCB
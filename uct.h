@@ -1,46 +1,193 @@
 #ifndef MCTS_UCT
 #define MCTS_UCT
 
+#include "arena.h"
+#include "atomic_ops.h"
 #include "debug_logger.h"
 #include "game.h"
 #include "policy.h"
+#include "thread_pool.h"
+#include "transposition_table.h"
+#include "ucb.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <map>
+#include <limits>
 #include <math.h>
 #include <memory>
 #include <optional>
 #include <queue>
+#include <thread>
+#include <vector>
+
+// GameT is the game type that rollouts are called with. See IsGame in game.h.
+template <class State, class Action, class GameT = Game<State, Action>>
+class UCT {
+  static_assert(IsGame<GameT, State, Action>,
+                "GameT must implement Game<State, Action>");
 
-template <class State, class Action> class UCT {
 public:
   // exploration param, approx sqrt(2)
   static constexpr double C = 1.41;
+  static constexpr int kNumPlayers = Game<State, Action>::kNumPlayers;
+  static constexpr int kMaxActions = GameTraits<State, Action>::kMaxActions;
+  // Reward counted against an edge while a searchShared rollout is under it.
+  static constexpr double kVirtualLoss = 1.0;
+  // Rollouts searchShared runs between making room for new nodes and edges.
+  static constexpr int kRolloutsPerRound = 1 << 14;
+  // Rollouts search runs between looking at the clock. A rollout takes around
+  // a microsecond, so this keeps the clock reads cheap without overshooting
+  // the deadline by much.
+  static constexpr int kRolloutsPerClockCheck = 16;
+  // Rollouts each thread runs between budget checks when search uses
+  // several threads.
+  static constexpr int kSharedRolloutsPerCheck = 256;
+  // Reward an edge is given once its move is proven to lose, so that UCB never
+  // picks it again.
+  static constexpr double kProvenLossReward = -1e30;
+  // Reward an edge is given once its move is proven to draw. Playing it again
+  // only backs up the same draw, and the node can't be proven until its other
+  // moves are, so UCB picks it after any unproven move but still before a
+  // move proven to lose.
+  static constexpr double kProvenDrawReward = -1e15;
+  using Reward = typename Game<State, Action>::Reward;
+
+  // Outcome a node has been proven to have under perfect play, for the player
+  // who made the move into it. See RolloutConfig::solve.
+  enum class Proof : int8_t { kUnknown, kWin, kLoss, kDraw };
 
   // Node stores statistics of games played starting from a given state.
   // total_reward stores the reward for each player for all games starting from
   // here
   struct Node {
     Node(const State &state_)
-        : num_rollouts_involved(0),
-          total_reward_from_here({{0, 0.0}, {1, 0.0}}), state(state_) {}
+        : num_rollouts_involved(0), total_reward_from_here(),
+          first_edge(kNullHandle), num_edges(0), num_tried(0),
+          proof(Proof::kUnknown), state(state_) {}
     int num_rollouts_involved;
-    RewardMap total_reward_from_here;
-    std::map<Action, Node *> children;
+    Reward total_reward_from_here;
+    // Once the node is expanded, its children are the edges
+    // [first_edge, first_edge + num_edges) in edges_.
+    Handle first_edge;
+    int num_edges;
+    // Edges are tried in order, so the first num_tried edges have a child
+    // node and the rest have never been played.
+    int num_tried;
+    Proof proof;
     // let's store the board in the node as well for visualization.
     State state;
+
+    bool isExpanded() const { return first_edge != kNullHandle; }
+  };
+
+  // Children of every expanded node, stored as parallel arrays so that
+  // selection can score all of a node's children with a few vector loads. Each
+  // expanded node owns one contiguous block of edges, one per valid action.
+  //
+  // Edge statistics count the rollouts that went through that edge, which
+  // differs from the child's node statistics when the child can also be
+  // reached through other parents.
+  struct Edges {
+    std::vector<Action> action;
+    std::vector<Handle> child;
+    std::vector<int32_t> num_rollouts_involved;
+    // Total reward for each player of rollouts through the edge.
+    std::array<std::vector<double>, kNumPlayers> total_reward;
+    // Number of edges handed out. The arrays can be longer than this, after
+    // resizeShared.
+    uint32_t used = 0;
+
+    // Appends a block of edges for actions, returning the first edge.
+    template <class Actions> Handle allocate(const Actions &actions) {
+      const Handle first = used;
+      for (const Action &a : actions) {
+        if (used == action.size()) {
+          action.push_back(a);
+          child.push_back(kNullHandle);
+          num_rollouts_involved.push_back(0);
+          for (auto &player_reward : total_reward) {
+            player_reward.push_back(0.0);
+          }
+        } else {
+          set(used, a);
+        }
+        used++;
+      }
+      return first;
+    }
+
+    // Hands out a block of n edges, for the caller to fill in with set. Safe
+    // to call from several threads at once. Returns kNullHandle once the
+    // arrays, which only resizeShared lengthens, have no room for n more.
+    Handle allocateShared(int n) {
+      const uint32_t capacity =
+          std::min<size_t>(action.size(), kNullHandle);
+      Handle first;
+      if (!atomicFetchAddUpTo(used, (uint32_t)n, capacity, &first)) {
+        return kNullHandle;
+      }
+      return first;
+    }
+
+    // Makes edge i an untried edge for action a.
+    void set(Handle i, const Action &a) {
+      action[i] = a;
+      child[i] = kNullHandle;
+      num_rollouts_involved[i] = 0;
+      for (auto &player_reward : total_reward) {
+        player_reward[i] = 0.0;
+      }
+    }
+
+    // Lengthens the arrays to n edges, for allocateShared to hand out. The new
+    // edges are copies of filler until they're set.
+    void resizeShared(size_t n, const Action &filler) {
+      if (n <= action.size()) {
+        return;
+      }
+      action.resize(n, filler);
+      child.resize(n, kNullHandle);
+      num_rollouts_involved.resize(n, 0);
+      for (auto &player_reward : total_reward) {
+        player_reward.resize(n, 0.0);
+      }
+    }
+
+    void reserve(size_t n) {
+      action.reserve(n);
+      child.reserve(n);
+      num_rollouts_involved.reserve(n);
+      for (auto &player_reward : total_reward) {
+        player_reward.reserve(n);
+      }
+    }
+
+    void clear() {
+      action.clear();
+      child.clear();
+      num_rollouts_involved.clear();
+      for (auto &player_reward : total_reward) {
+        player_reward.clear();
+      }
+      used = 0;
+    }
+
+    size_t size() const { return atomicLoad(used); }
   };
 
   // Vector of these can be used to store history of a rollout.
   struct HistoryFrame {
-    HistoryFrame(std::optional<Action> action_, RewardMap reward_,
+    HistoryFrame(std::optional<Action> action_, const Reward &reward_,
                  const State &state_, int player_num_)
         : action(action_), reward(reward_), state(state_),
           player_num(player_num_) {}
     // Action that created this node or nullopt for root node.
     std::optional<Action> action;
     // Reward after taking action
-    RewardMap reward;
+    Reward reward;
     // State after taking action
     State state;
     // player number who took the action
@@ -48,38 +195,182 @@ public:
   };
 
   struct RolloutConfig {
-    bool update_weights;
-    bool opponent_goes_first;
     bool verbose = false;
+    // MCTS-Solver: prove the outcome of nodes whose children's outcomes are
+    // known, starting from the end of the game. A rollout that reaches a
+    // proven node stops there and takes its proven reward, moves proven to
+    // lose are never selected again, and search stops once the root is
+    // proven. Proofs assume two players taking turns, with a reward of 1, -1
+    // or 0 only at the end of the game, as in tic-tac-toe, which the Game
+    // interface doesn't promise, so this is off unless asked for.
+    // searchShared doesn't prove anything.
+    bool solve = false;
+    // Random playouts run from each newly expanded leaf. Their rewards are
+    // averaged, giving a less noisy value for the leaf at the cost of more
+    // simulation per rollout.
+    int playouts_per_leaf = 1;
+    // Threads that rollout splits each leaf's playouts over, counting the
+    // calling thread. The others are tasks on ThreadPool::global(), each with
+    // a game and policy clone kept for later rollouts. Handing out the
+    // playouts costs a few microseconds, so this only pays off with many
+    // playouts per leaf. Not used by searchShared, which parallelizes whole
+    // rollouts.
+    int num_threads = 1;
   };
 
-  UCT() {
-    nodes_.insert(std::make_pair(State(), Node(State())));
-    root_ = &(nodes_.at(State()));
-  }
+  // Limits for search, which stops at whichever it reaches first. Unset
+  // limits don't apply, but at least one has to be set.
+  struct SearchBudget {
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    int max_rollouts = std::numeric_limits<int>::max();
+    // Limit on the size of the whole tree, not just the nodes this search
+    // adds, so that it bounds memory use. A rollout can add two nodes, so the
+    // tree may end up one node over.
+    size_t max_nodes = std::numeric_limits<size_t>::max();
 
-  // Create a node corresponding to the current game state and link it as a
-  // child of parent_node
-  Node &getOrCreateNode(const State &state, const Action action,
-                        Node &parent_node) {
-    if (nodes_.find(state) == nodes_.end()) {
-      nodes_.emplace(state, Node(state));
+    // A budget of time from now.
+    static SearchBudget forDuration(std::chrono::steady_clock::duration d) {
+      SearchBudget budget;
+      budget.deadline = std::chrono::steady_clock::now() + d;
+      return budget;
     }
+  };
+
+  struct SearchResult {
+    // The most promising move from the root, or nullopt if the game is
+    // already over there.
+    std::optional<Action> best_action;
+    // The root's proven outcome, for the player to move there, if the search
+    // has solved it.
+    Proof root_proof = Proof::kUnknown;
+    int num_rollouts = 0;
+    size_t num_nodes_created = 0;
+    std::chrono::steady_clock::duration elapsed{};
+  };
 
-    if (parent_node.children.find(action) == parent_node.children.end()) {
-      parent_node.children.insert(std::make_pair(action, &nodes_.at(state)));
+  UCT() { root_ = getOrCreateHandle(State()); }
+
+  // The position rollouts start from. A new tree starts from the initial
+  // position.
+  const State &rootState() const { return root_state_; }
+
+  // Moves the root to state, so that rollouts start from there. Whatever was
+  // learned below state is kept, and the nodes that can't be reached from it
+  // any more are freed. After a real move, rerooting at the new position
+  // keeps the statistics of the rollouts that went through it.
+  void reroot(const State &state) {
+    TranspositionTable<Handle> nodes;
+    Arena<Node> node_arena;
+    Edges edges;
+    // Copy the nodes reachable from state breadth first, remembering where
+    // each old node went. A node reached through several parents is copied
+    // once.
+    std::vector<Handle> new_handles(node_arena_.size(), kNullHandle);
+    std::vector<Handle> queue;
+    auto copyNode = [&](Handle old_handle) {
+      const Node &old_node = node_arena_[old_handle];
+      const Handle handle = node_arena.allocate(old_node);
+      nodes.findOrInsert(key(old_node.state)).first = handle;
+      new_handles[old_handle] = handle;
+      queue.push_back(old_handle);
+      return handle;
+    };
+    const Handle *old_root = nodes_.find(key(state));
+    if (old_root != nullptr) {
+      root_ = copyNode(*old_root);
+    } else {
+      root_ = node_arena.allocate(state);
+      nodes.findOrInsert(key(state)).first = root_;
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+      const Node &old_node = node_arena_[queue[i]];
+      if (!old_node.isExpanded()) {
+        continue;
+      }
+      valid_actions_.clear();
+      for (int e = 0; e < old_node.num_edges; e++) {
+        valid_actions_.push_back(edges_.action[old_node.first_edge + e]);
+      }
+      const Handle first_edge = edges.allocate(valid_actions_);
+      node_arena[new_handles[queue[i]]].first_edge = first_edge;
+      // Only tried edges have statistics and children.
+      for (int e = 0; e < old_node.num_tried; e++) {
+        const Handle old_edge = old_node.first_edge + e;
+        const Handle edge = first_edge + e;
+        const Handle old_child = edges_.child[old_edge];
+        edges.child[edge] = new_handles[old_child] != kNullHandle
+                                ? new_handles[old_child]
+                                : copyNode(old_child);
+        edges.num_rollouts_involved[edge] =
+            edges_.num_rollouts_involved[old_edge];
+        for (int player = 0; player < kNumPlayers; player++) {
+          edges.total_reward[player][edge] =
+              edges_.total_reward[player][old_edge];
+        }
+      }
     }
+    nodes_ = std::move(nodes);
+    node_arena_.swap(node_arena);
+    edges_ = std::move(edges);
+    shared_scratch_.clear();
+    root_state_ = state;
+  }
+
+  // Allocates room for about num_nodes nodes up front, so that growing the
+  // tree during rollouts doesn't have to.
+  void reserve(size_t num_nodes) {
+    nodes_.reserve(num_nodes);
+    node_arena_.reserve(num_nodes);
+    edges_.reserve(num_nodes);
+  }
+
+  // Throws away the whole tree at once, keeping the memory for reuse.
+  void clear() {
+    nodes_.clear();
+    node_arena_.clear();
+    edges_.clear();
+    shared_scratch_.clear();
+    root_state_ = State();
+    root_ = getOrCreateHandle(root_state_);
+  }
+
+  // Gives the node at handle one edge per valid action in the game's current
+  // state, which must be the node's state. Child nodes aren't created until
+  // their edge is first played, see tryEdge.
+  void expand(Handle handle, const GameT *game) {
+    Node &node = node_arena_[handle];
+    assert(!node.isExpanded());
+    game->getValidActions(valid_actions_);
+    node.first_edge = edges_.allocate(valid_actions_);
+    node.num_edges = valid_actions_.size();
+  }
 
-    return nodes_.at(state);
+  Node &getNode(const GameT *const game) {
+    return getNode(game->getCurrentState());
   }
 
-  Node &getNode(const Game<State, Action> *const game) {
+  Node &getNode(const State &state) {
+    const Handle *handle = nodes_.find(key(state));
     // Should remove this assert once we are sure in logic.
+    assert(handle != nullptr);
+    return node_arena_[*handle];
+  }
+
+  // For introspection. Returns nullptr if state was never visited.
+  const Node *findNode(const State &state) const {
+    return findNode(key(state));
+  }
 
-    assert(nodes_.find(game->getCurrentState()) != nodes_.end());
-    return nodes_.at(game->getCurrentState());
+  // Same, by state hash.
+  const Node *findNode(uint64_t state_hash) const {
+    const Handle *handle = nodes_.find(state_hash);
+    return handle == nullptr ? nullptr : &node_arena_[*handle];
   }
 
+  // Nodes in the tree. Nodes that searchShared set aside for reuse aren't
+  // counted.
+  size_t numNodes() const { return nodes_.size(); }
+
   // Rolls out a game, playing both players.
   // For each rollout, we first do selection of nodes using UCB until we hit a
   // node that we haven't explored before.
@@ -88,40 +379,83 @@ public:
   //
   // simulation_policy is used to simulate both players once we reach simulation
   // stage. a random policy is usually fine for this.
-  std::vector<HistoryFrame> rollout(Game<State, Action> *game,
-                                    Policy<State, Action> *simulation_policy,
-                                    bool verbose = false) {
-    game->reset();
+  //
+  // The returned history is reused by the next rollout, so that rollouts
+  // don't allocate once the buffers have grown to the depth of the game.
+  //
+  // Passing a RandomValidPolicy (rather than a Policy) pointer lets the
+  // simulation moves be inlined too.
+  template <class SimulationPolicy>
+  const std::vector<HistoryFrame> &
+  rollout(GameT *game, SimulationPolicy *simulation_policy,
+          bool verbose = false) {
+    RolloutConfig config;
+    config.verbose = verbose;
+    return rollout(game, simulation_policy, config);
+  }
+
+  template <class SimulationPolicy>
+  const std::vector<HistoryFrame> &rollout(GameT *game,
+                                           SimulationPolicy *simulation_policy,
+                                           const RolloutConfig &config) {
+    const bool verbose = config.verbose;
+    game->setCurrentState(root_state_);
 
     DebugLogger logger(verbose);
 
-    std::vector<HistoryFrame> rollout_history;
+    std::vector<HistoryFrame> &rollout_history = rollout_history_;
+    rollout_history.clear();
     // Start with the initial board in the rollout history always.
-    rollout_history.emplace_back(std::nullopt, TwoPlayerNobodyWinsReward,
+    rollout_history.emplace_back(std::nullopt, Reward(),
                                  game->getCurrentState(), 0);
 
+    // Edge taken into each frame of rollout_history after the root, for
+    // backprop.
+    std::vector<Handle> &edge_path = edge_path_;
+    edge_path.clear();
+
     // 1. Selection - recursively choose best child node using UCB until we hit
     // a leaf node.
-    // 2. Expansion - Since getBestActionIdx will return the first non-explored
+    // 2. Expansion - Since selectEdge will return the first non-explored
     // child node, this does the expansion phase as well.
-    Node* cur_node = root_;
+    Handle cur_handle = root_;
     logger << "Selection phase: " << std::endl;
-    while (!cur_node->children.empty()) {
-      logger << "calling best action idx with cur_node: " << cur_node->state.render() << " and game state: " << game->getCurrentState().render() << std::endl;
-      int selected_action_idx = getBestActionIdx(game, *cur_node);
-      const Action chosen_action =
-          game->getValidActions().at(selected_action_idx);
+    const bool solve = config.solve && kNumPlayers == 2;
+    while (node_arena_[cur_handle].isExpanded() &&
+           !(solve && node_arena_[cur_handle].proof != Proof::kUnknown)) {
+      const Node &cur_node = node_arena_[cur_handle];
+      // Rendering allocates, so only build log messages when verbose.
+      if (verbose) {
+        logger << "selecting edge with cur_node: " << cur_node.state.render() << " and game state: " << game->getCurrentState().render() << std::endl;
+      }
+      const Handle edge = selectEdge(cur_node);
+      const Action chosen_action = edges_.action[edge];
       int player_turn = game->turn();
-      logger << "selected action: " << chosen_action.toString()
-             << " for turn: " << player_turn << std::endl;
-      RewardMap reward = game->simulate(chosen_action);
+      if (verbose) {
+        logger << "selected action: " << chosen_action.toString()
+               << " for turn: " << player_turn << std::endl;
+      }
+      const Reward reward = game->simulate(chosen_action);
 
       rollout_history.emplace_back(chosen_action, reward,
                                    game->getCurrentState(), player_turn);
-      cur_node = &getNode(game);
+      edge_path.push_back(edge);
+      if (edges_.child[edge] == kNullHandle) {
+        tryEdge(cur_handle, edge, game->getCurrentState());
+      }
+      cur_handle = edges_.child[edge];
     }
 
-    bool need_to_update_cur_node = !game->isTerminal();
+    // The outcome of a proven node is known, so there is nothing to simulate.
+    const Proof reached_proof = node_arena_[cur_handle].proof;
+    bool leaf_terminal = game->isTerminal();
+    bool need_to_update_cur_node =
+        !leaf_terminal && !(solve && reached_proof != Proof::kUnknown);
+    if (solve && reached_proof != Proof::kUnknown && !leaf_terminal &&
+        !edge_path.empty()) {
+      rollout_history.back().reward +=
+          provenReward(reached_proof, rollout_history.back().player_num);
+    }
 
     // 3. Simulation
     if (need_to_update_cur_node) {
@@ -135,35 +469,36 @@ public:
 
       // Since cur_node has no children, pick one of the children to expand.
       {
-        const Action action = simulation_policy->act(game);
-        const RewardMap reward = game->simulate(action);
-        const Node &child_node =
-            getOrCreateNode(game->getCurrentState(), action, *cur_node);
+        expand(cur_handle, game);
+        const Action action =
+            actWith<State, Action>(simulation_policy, game);
+        Handle edge = findEdge(node_arena_[cur_handle], action);
+        const Reward reward = game->simulate(action);
+        leaf_terminal = game->isTerminal();
+        // The policy may not have picked the first untried edge, so swap its
+        // edge into that position to keep the tried edges in front.
+        edge = tryEdge(cur_handle, edge, game->getCurrentState());
         rollout_history.emplace_back(action, reward, game->getCurrentState(),
                                      player_turn);
-        logger << "simulation action: " << action.toString()
-               << " receives reward " << reward.at(player_turn)
-               << " resulting in board state: " << std::endl
-               << rollout_history.back().state.render() << std::endl;
+        edge_path.push_back(edge);
+        if (verbose) {
+          logger << "simulation action: " << action.toString()
+                 << " receives reward " << reward.at(player_turn)
+                 << " resulting in board state: " << std::endl
+                 << rollout_history.back().state.render() << std::endl;
+        }
       }
 
       // We've created a child node, and we need to do a random simulation from
       // here to terminal state to get a reward for this node, without storing
-      // any of it in the rollout history. Could also do a light playout
-      // instead.
-      int simulated_player = game->turn();
-
-      while (!game->isTerminal()) {
-        const Action action = simulation_policy->act(game);
-        RewardMap reward = game->simulate(action);
-        logger << "simulation action: " << action.toString()
-               << " receives reward " << reward.at(simulated_player)
-               << " resulting in board state: " << std::endl
-               << game->getCurrentState().render() << std::endl;
-        // Use received reward as a proxy for the reward from the earlier leaf
-        // node. Modify what we've stored in the rollout history to include what
-        // we think we should receive from here on out.
-        rollout_history.back().reward += reward;
+      // any of it in the rollout history. Use the reward received as a proxy
+      // for the reward from the earlier leaf node.
+      if (config.num_threads > 1 && config.playouts_per_leaf > 1 && !verbose) {
+        rollout_history.back().reward +=
+            playOutOnWorkers(game, simulation_policy, config);
+      } else {
+        rollout_history.back().reward +=
+            playOut(game, simulation_policy, config, logger);
       }
     }
 
@@ -178,82 +513,301 @@ public:
     // Second frame will be some child state
     //
     logger << "Backprop!" << std::endl;
-    RewardMap reward_from_here_for_rollout = TwoPlayerNobodyWinsReward;
-    for (auto rit = rollout_history.rbegin(); rit != rollout_history.rend();
-         ++rit) {
+    Reward reward_from_here_for_rollout;
+    for (int i = rollout_history.size() - 1; i >= 0; i--) {
       // All nodes should exist already
-      const auto &frame = *rit;
-      Node &node = nodes_.at(frame.state);
-      node.num_rollouts_involved++;
+      const auto &frame = rollout_history[i];
       reward_from_here_for_rollout += frame.reward;
-      logger << "update node with state: " << std::endl << frame.state.render() << " with reward map: " << reward_from_here_for_rollout.toString() << std::endl;
+      const Handle handle = i == 0 ? root_ : edges_.child[edge_path[i - 1]];
+      Node &node = node_arena_[handle];
+      node.num_rollouts_involved++;
+      if (verbose) {
+        logger << "update node with state: " << std::endl << frame.state.render() << " with reward map: " << reward_from_here_for_rollout.toString() << std::endl;
+      }
       node.total_reward_from_here += reward_from_here_for_rollout;
+      if (i > 0) {
+        const Handle edge = edge_path[i - 1];
+        edges_.num_rollouts_involved[edge]++;
+        for (int player = 0; player < kNumPlayers; player++) {
+          edges_.total_reward[player][edge] +=
+              reward_from_here_for_rollout.at(player);
+        }
+      }
+    }
+    if (solve) {
+      updateProofs(leaf_terminal);
     }
 
-    // reset the game to be a good citizen :)
-    game->reset();
+    // Put the game back at the root to be a good citizen :)
+    game->setCurrentState(root_state_);
     return rollout_history;
   }
 
-  // Should only be called if current_node has at least one child.
-  // If it does, we should have at least one simulation going through here.
-  // Goes through all possible actions and returns best UCB value, returning the
-  // index of any unexplored actions first.
-  int getBestActionIdx(const Game<State, Action> *game, Node &current_node) {
+  // Root parallel search: runs num_rollouts rollouts split over num_threads
+  // threads, each growing a private tree from the root, and then merges the
+  // private trees into this one.
+  //
+  // The first thread grows this tree directly, using game and
+  // simulation_policy. The others play on clones of them, see threadCopies.
+  // The threads are tasks on ThreadPool::global(), so num_threads is the
+  // number of trees, and how many grow at once depends on the pool.
+  template <class SimulationPolicy>
+  void searchParallel(GameT *game, SimulationPolicy *simulation_policy,
+                      int num_rollouts, int num_threads,
+                      const RolloutConfig &config = RolloutConfig()) {
+    std::vector<std::unique_ptr<UCT>> trees(num_threads);
+    for (int t = 1; t < num_threads; t++) {
+      trees[t] = std::make_unique<UCT>();
+      trees[t]->reroot(root_state_);
+    }
+    const ThreadCopies<SimulationPolicy> copies =
+        threadCopies(game, simulation_policy, num_threads);
+    runOnThreads(copies, [&](int t, GameT *thread_game,
+                             SimulationPolicy *thread_policy) {
+      UCT &tree = t == 0 ? *this : *trees[t];
+      const int thread_rollouts =
+          rolloutsForThread(num_rollouts, num_threads, t);
+      for (int i = 0; i < thread_rollouts; i++) {
+        tree.rollout(thread_game, thread_policy, config);
+      }
+    });
+    for (int t = 1; t < num_threads; t++) {
+      merge(*trees[t]);
+    }
+  }
 
-    const std::vector<Action> &valid_actions = game->getValidActions();
-    assert(!valid_actions.empty());
-    assert(current_node.num_rollouts_involved != 0);
+  // Tree parallel search: num_threads threads run num_rollouts rollouts
+  // between them, all on this tree. Threads are set up as in searchParallel.
+  //
+  // Nothing is locked. Statistics are updated atomically. A node's edges and
+  // an edge's child are published by compare-and-swap, and a thread that
+  // loses the race keeps what it built for its next expansion. Nodes are
+  // looked up and inserted concurrently in the transposition table.
+  //
+  // While a rollout is on its way down, each edge it took counts an extra
+  // visit and a loss of kVirtualLoss for the player who chose it, which
+  // backprop takes back. That steers the other threads towards different
+  // branches instead of all piling into the current best one.
+  //
+  // Rollouts run in rounds of kRolloutsPerRound. Before each round, room is
+  // made for the most nodes and edges it could add, so that nothing moves
+  // while threads are reading it.
+  template <class SimulationPolicy>
+  void searchShared(GameT *game, SimulationPolicy *simulation_policy,
+                    int num_rollouts, int num_threads,
+                    const RolloutConfig &config = RolloutConfig()) {
+    game->setCurrentState(root_state_);
+    if (game->isTerminal()) {
+      return;
+    }
+    game->getValidActions(valid_actions_);
+    const Action filler = valid_actions_[0];
 
-    const State &current_state = game->getCurrentState();
-    const int current_node_turn = current_state.getTurn();
+    const ThreadCopies<SimulationPolicy> copies =
+        threadCopies(game, simulation_policy, num_threads);
+    if (shared_scratch_.size() < (size_t)num_threads) {
+      shared_scratch_.resize(num_threads);
+    }
+    for (int done = 0; done < num_rollouts; done += kRolloutsPerRound) {
+      const int round = std::min(kRolloutsPerRound, num_rollouts - done);
+      // A rollout adds at most two nodes, and allocates edges for at most one
+      // expansion. A node a thread didn't get to use waits in its free list.
+      const size_t max_nodes =
+          node_arena_.size() + 2 * (size_t)round + num_threads;
+      node_arena_.reserve(max_nodes);
+      nodes_.reserve(max_nodes);
+      edges_.resizeShared(edges_.size() + (size_t)round * kMaxActions, filler);
 
-    double best_ucb_so_far = std::numeric_limits<double>::lowest();
-    double best_idx_so_far = -1;
+      std::atomic<int> rollouts_started(0);
+      runOnThreads(copies, [&](int t, GameT *thread_game,
+                               SimulationPolicy *thread_policy) {
+        while (rollouts_started.fetch_add(1, std::memory_order_relaxed) <
+               round) {
+          rolloutShared(thread_game, thread_policy, config,
+                        shared_scratch_[t]);
+        }
+      });
+    }
+  }
 
-    for (int i = 0; i < valid_actions.size(); i++) {
-      const Action &action = valid_actions.at(i);
-      const std::pair<State, RewardMap> state_reward =
-          game->simulateDry(current_state, action);
-      const Node &child_node =
-          getOrCreateNode(state_reward.first, action, current_node);
-
-      double ucb = getUcb(
-          child_node.total_reward_from_here.at(current_node_turn),
-          child_node.num_rollouts_involved, current_node.num_rollouts_involved);
-      if (ucb > best_ucb_so_far) {
-        best_ucb_so_far = ucb;
-        best_idx_so_far = i;
-        // Return early if we have infinity
-        if (ucb == std::numeric_limits<double>::max()) {
-          return i;
+  // Anytime search from the game's current position: reroots the tree there if
+  // it isn't the root already, runs rollouts until the budget runs out, and
+  // returns the best move along with what the search did. With
+  // num_threads > 1, the rollouts run on a shared tree as in searchShared,
+  // kSharedRolloutsPerCheck per thread between budget checks, so the deadline
+  // can be overshot by that many rollouts' time.
+  template <class SimulationPolicy>
+  SearchResult search(GameT *game, SimulationPolicy *simulation_policy,
+                      const SearchBudget &budget, int num_threads = 1,
+                      const RolloutConfig &config = RolloutConfig()) {
+    assert((budget.deadline.has_value() ||
+            budget.max_rollouts < std::numeric_limits<int>::max() ||
+            budget.max_nodes < std::numeric_limits<size_t>::max()) &&
+           "search needs a limit");
+    const auto start = std::chrono::steady_clock::now();
+    if (key(game->getCurrentState()) != key(root_state_)) {
+      reroot(game->getCurrentState());
+    }
+    const size_t start_nodes = numNodes();
+    SearchResult result;
+    if (!game->isTerminal()) {
+      auto outOfTime = [&]() {
+        return budget.deadline.has_value() &&
+               std::chrono::steady_clock::now() >= *budget.deadline;
+      };
+      if (num_threads <= 1) {
+        while (result.num_rollouts < budget.max_rollouts &&
+               numNodes() < budget.max_nodes &&
+               node_arena_[root_].proof == Proof::kUnknown &&
+               (result.num_rollouts % kRolloutsPerClockCheck != 0 ||
+                !outOfTime())) {
+          rollout(game, simulation_policy, config);
+          result.num_rollouts++;
+        }
+      } else {
+        // A rollout adds at most two nodes, so capping a batch at half the
+        // nodes left keeps the tree within max_nodes.
+        while (result.num_rollouts < budget.max_rollouts &&
+               numNodes() < budget.max_nodes &&
+               node_arena_[root_].proof == Proof::kUnknown && !outOfTime()) {
+          const size_t batch = std::min(
+              {(size_t)kSharedRolloutsPerCheck * num_threads,
+               (size_t)(budget.max_rollouts - result.num_rollouts),
+               std::max<size_t>(1, (budget.max_nodes - numNodes()) / 2)});
+          searchShared(game, simulation_policy, (int)batch, num_threads,
+                       config);
+          result.num_rollouts += batch;
         }
       }
+      game->setCurrentState(root_state_);
+      result.best_action = actGreedily(game);
+    }
+    // The root's proof is for whoever moved into it.
+    switch (node_arena_[root_].proof) {
+    case Proof::kWin:
+      result.root_proof = Proof::kLoss;
+      break;
+    case Proof::kLoss:
+      result.root_proof = Proof::kWin;
+      break;
+    default:
+      result.root_proof = node_arena_[root_].proof;
     }
-    return best_idx_so_far;
+    result.num_nodes_created = numNodes() - start_nodes;
+    result.elapsed = std::chrono::steady_clock::now() - start;
+    return result;
+  }
+
+  // Adds the statistics of every node and edge of other into this tree,
+  // creating the nodes and edges this tree doesn't have yet. Nodes are matched
+  // by state hash, so trees grown separately from the same root line up.
+  void merge(const UCT &other) {
+    for (Handle other_handle = 0; other_handle < other.node_arena_.size();
+         other_handle++) {
+      const Node &other_node = other.node_arena_[other_handle];
+      const Handle *stored = other.nodes_.find(key(other_node.state));
+      if (stored == nullptr || *stored != other_handle) {
+        // Set aside by searchShared, not part of the tree.
+        continue;
+      }
+      const Handle handle = getOrCreateHandle(other_node.state);
+      {
+        Node &node = node_arena_[handle];
+        node.num_rollouts_involved += other_node.num_rollouts_involved;
+        node.total_reward_from_here += other_node.total_reward_from_here;
+        if (node.proof == Proof::kUnknown) {
+          node.proof = other_node.proof;
+        }
+      }
+      if (!other_node.isExpanded()) {
+        continue;
+      }
+      if (!node_arena_[handle].isExpanded()) {
+        valid_actions_.clear();
+        for (int i = 0; i < other_node.num_edges; i++) {
+          valid_actions_.push_back(
+              other.edges_.action[other_node.first_edge + i]);
+        }
+        Node &node = node_arena_[handle];
+        node.first_edge = edges_.allocate(valid_actions_);
+        node.num_edges = valid_actions_.size();
+      }
+      // Only tried edges have statistics.
+      for (int i = 0; i < other_node.num_tried; i++) {
+        const Handle other_edge = other_node.first_edge + i;
+        Handle edge =
+            findEdge(node_arena_[handle], other.edges_.action[other_edge]);
+        if (edges_.child[edge] == kNullHandle) {
+          const State &child_state =
+              other.node_arena_[other.edges_.child[other_edge]].state;
+          edge = tryEdge(handle, edge, child_state);
+        }
+        edges_.num_rollouts_involved[edge] +=
+            other.edges_.num_rollouts_involved[other_edge];
+        for (int player = 0; player < kNumPlayers; player++) {
+          edges_.total_reward[player][edge] +=
+              other.edges_.total_reward[player][other_edge];
+        }
+      }
+    }
+  }
+
+  // Should only be called on an expanded node, which has had at least one
+  // simulation go through it. Returns the first untried edge if there is one,
+  // and otherwise scores all of the node's children with UCB at once and
+  // returns the best edge.
+  Handle selectEdge(const Node &current_node) const {
+    assert(current_node.isExpanded() && current_node.num_edges > 0);
+    assert(current_node.num_rollouts_involved != 0);
+    if (current_node.num_tried < current_node.num_edges) {
+      return current_node.first_edge + current_node.num_tried;
+    }
+    const int current_node_turn = current_node.state.getTurn();
+    const Handle first = current_node.first_edge;
+    const int best_idx = selectUcb(
+        edges_.num_rollouts_involved.data() + first,
+        edges_.total_reward[current_node_turn].data() + first,
+        current_node.num_edges,
+        log((double)current_node.num_rollouts_involved), C);
+    assert(best_idx >= 0);
+    return first + best_idx;
   }
 
   // Used only for evaluation
-  Action actGreedily(const Game<State, Action> *game) {
+  Action actGreedily(const GameT *game) {
     const State &current_state = game->getCurrentState();
     const int current_turn = current_state.getTurn();
     const std::vector<Action> &valid_actions = game->getValidActions();
     assert(!valid_actions.empty());
-    int best_idx = 0;
+    size_t best_idx = 0;
     double best_value = std::numeric_limits<double>::lowest();
-    for (int i = 0; i < valid_actions.size(); i++) {
+    for (size_t i = 0; i < valid_actions.size(); i++) {
       const Action &action = valid_actions.at(i);
-      const std::pair<State, RewardMap> state_reward =
-          game->simulateDry(current_state, action);
-      if (nodes_.find(state_reward.first) == nodes_.end()) {
+      const Node *child_node_ptr =
+          findNode(game->childHash(current_state, action));
+      if (child_node_ptr == nullptr) {
         // Don't try anything we don't haven't tried before.
         continue;
       }
-      const Node &child_node = nodes_.at(state_reward.first);
+      const Node &child_node = *child_node_ptr;
       // Shouldn't have any nodes created with zero rollouts
       assert(child_node.num_rollouts_involved != 0);
       double value = (child_node.total_reward_from_here.at(current_turn) /
                       child_node.num_rollouts_involved);
+      // A proven outcome beats any estimate.
+      switch (child_node.proof) {
+      case Proof::kWin:
+        value = std::numeric_limits<double>::max();
+        break;
+      case Proof::kLoss:
+        value = std::numeric_limits<double>::lowest() / 2;
+        break;
+      case Proof::kDraw:
+        value = 0.0;
+        break;
+      case Proof::kUnknown:
+        break;
+      }
       if (value > best_value) {
         best_value = value;
         best_idx = i;
@@ -262,8 +816,90 @@ public:
     return valid_actions.at(best_idx);
   }
 
+  // Plays a game against opponent_policy, searching from each position
+  // reached for time_per_move before our moves. The tree is rerooted as the
+  // game goes on, so each search builds on what the earlier ones learned
+  // about the position. Returns our reward for the last move.
+  //
+  // With ponder set, the tree also keeps searching while opponent_policy
+  // picks its move, see startPondering.
+  template <class SimulationPolicy>
+  double playSearching(GameT *game, Policy<State, Action> *opponent_policy,
+                       bool opponent_goes_first,
+                       SimulationPolicy *simulation_policy,
+                       std::chrono::steady_clock::duration time_per_move,
+                       int num_threads = 1, bool verbose = false,
+                       bool ponder = false) {
+    const int player_num = opponent_goes_first ? 1 : 0;
+    game->reset();
+    double final_reward = 0.0;
+    while (!game->isTerminal()) {
+      Action action = [&]() {
+        if (game->turn() == player_num) {
+          const SearchResult result =
+              search(game, simulation_policy,
+                     SearchBudget::forDuration(time_per_move), num_threads);
+          if (verbose) {
+            std::cout << "searched " << result.num_rollouts << " rollouts"
+                      << std::endl;
+          }
+          return *result.best_action;
+        }
+        if (!ponder) {
+          return opponent_policy->act(game);
+        }
+        startPondering(game, simulation_policy, num_threads);
+        const Action opponent_action = opponent_policy->act(game);
+        const int pondered = stopPondering();
+        if (verbose) {
+          std::cout << "pondered " << pondered << " rollouts" << std::endl;
+        }
+        return opponent_action;
+      }();
+      final_reward = game->simulate(action).at(player_num);
+      if (verbose) {
+        std::cout << game->render();
+      }
+    }
+    game->reset();
+    return final_reward;
+  }
+
+  // Starts searching from the game's current position on a background thread,
+  // to make use of the time an opponent spends choosing its move. The thread
+  // runs search in small batches with num_threads threads until
+  // stopPondering, or until the tree has max_nodes nodes. The game and
+  // policy are cloned, so the caller can keep using them, but nothing else
+  // may use the tree until pondering stops.
+  //
+  // The background thread mostly runs while the calling thread waits for the
+  // opponent, so it doesn't go through the thread pool, whose threads may
+  // all be busy.
+  template <class SimulationPolicy>
+  void startPondering(const GameT *game, SimulationPolicy *simulation_policy,
+                      int num_threads = 1,
+                      size_t max_nodes = std::numeric_limits<size_t>::max()) {
+    assert(ponderer_ == nullptr && "already pondering");
+    ponderer_ = std::make_unique<Ponderer>(this, game, simulation_policy,
+                                           num_threads, max_nodes);
+  }
+
+  // Stops pondering, waiting for the rollout batch in progress to finish.
+  // Returns the number of rollouts pondering ran. The next search from the
+  // opponent's chosen position keeps them.
+  int stopPondering() {
+    if (ponderer_ == nullptr) {
+      return 0;
+    }
+    const int num_rollouts = ponderer_->stop();
+    ponderer_.reset();
+    return num_rollouts;
+  }
+
+  bool isPondering() const { return ponderer_ != nullptr; }
+
   // Use this to play against the UCT
-  void evaluate(Game<State, Action> *game,
+  void evaluate(GameT *game,
                 Policy<State, Action> *opponent_policy,
                 bool opponent_goes_first) {
 
@@ -298,30 +934,617 @@ public:
     game->reset();
   }
 
-  const std::map<State, Node> &getNodes() { return nodes_; }
-
 private:
-  double getUcb(double child_total_reward, int child_num_rollouts,
-                int parent_num_rollouts) {
-    assert(parent_num_rollouts > 0);
-    // std::cout << "parent num rollouts: " << parent_num_rollouts << std::endl;
-    // std::cout << "child num rollouts: " << child_num_rollouts << std::endl;
-    // This would be true if we couldn't go to the same child from different parents..in tic tac toe that might not be true..
-    // assert(child_num_rollouts <= parent_num_rollouts);
+  static uint64_t key(const State &state) { return StateHash<State>()(state); }
+
+  // Reward of a node proven to have outcome proof for mover, the player who
+  // moved into it.
+  static Reward provenReward(Proof proof, int mover) {
+    Reward reward;
+    const double mover_reward = proof == Proof::kWin    ? 1.0
+                                : proof == Proof::kLoss ? -1.0
+                                                        : 0.0;
+    reward.at(mover) = mover_reward;
+    reward.at(1 - mover) = -mover_reward;
+    return reward;
+  }
+
+  // After backprop, proves what the last rollout's path lets us prove, from
+  // the leaf up: a terminal leaf has the outcome of its last move, and a node
+  // is proven once one of its moves is a proven win, or all of them are
+  // proven. A move proven to lose or draw gets kProvenLossReward or
+  // kProvenDrawReward on its edge.
+  void updateProofs(bool leaf_terminal) {
+    if (edge_path_.empty()) {
+      return;
+    }
+    Node &leaf = node_arena_[edges_.child[edge_path_.back()]];
+    if (leaf.proof == Proof::kUnknown && leaf_terminal) {
+      const HistoryFrame &frame = rollout_history_.back();
+      const double reward = frame.reward.at(frame.player_num);
+      leaf.proof = reward > 0   ? Proof::kWin
+                   : reward < 0 ? Proof::kLoss
+                                : Proof::kDraw;
+    }
+    for (int i = edge_path_.size(); i >= 1; i--) {
+      const Handle edge = edge_path_[i - 1];
+      const Proof child_proof = node_arena_[edges_.child[edge]].proof;
+      if (child_proof == Proof::kUnknown) {
+        return;
+      }
+      if (child_proof == Proof::kLoss) {
+        edges_.total_reward[rollout_history_[i].player_num][edge] =
+            kProvenLossReward;
+      } else if (child_proof == Proof::kDraw) {
+        edges_.total_reward[rollout_history_[i].player_num][edge] =
+            kProvenDrawReward;
+      }
+      Node &parent =
+          node_arena_[i == 1 ? root_ : edges_.child[edge_path_[i - 2]]];
+      if (parent.proof != Proof::kUnknown) {
+        return;
+      }
+      parent.proof = proveFromChildren(parent);
+      if (parent.proof == Proof::kUnknown) {
+        return;
+      }
+    }
+  }
+
+  // Outcome of node for the player who moved into it, from its children's
+  // proofs, which are for the player to move at node.
+  Proof proveFromChildren(const Node &node) const {
+    bool all_proven = node.num_tried == node.num_edges;
+    bool any_draw = false;
+    for (int i = 0; i < node.num_tried; i++) {
+      switch (node_arena_[edges_.child[node.first_edge + i]].proof) {
+      case Proof::kWin:
+        return Proof::kLoss;
+      case Proof::kDraw:
+        any_draw = true;
+        break;
+      case Proof::kUnknown:
+        all_proven = false;
+        break;
+      case Proof::kLoss:
+        break;
+      }
+    }
+    if (!all_proven) {
+      return Proof::kUnknown;
+    }
+    return any_draw ? Proof::kDraw : Proof::kWin;
+  }
+
+  // Reserves count stream numbers for clones of the simulation policies this
+  // tree is given, and returns the first. No two clones made for this tree
+  // share a stream, whichever search made them. searchParallel's other trees
+  // clone their threads' policies, which are clones themselves, so their
+  // clones' streams are split off from different streams, see Rng.
+  uint64_t takeCloneStreams(int count) {
+    const uint64_t first = next_clone_stream_;
+    next_clone_stream_ += count;
+    return first;
+  }
+
+  // Share of num_rollouts run by thread t, spreading the remainder over the
+  // first threads.
+  static int rolloutsForThread(int num_rollouts, int num_threads, int t) {
+    return num_rollouts / num_threads + (t < num_rollouts % num_threads);
+  }
+
+  // Find the node for state, creating it if this is the first time we've seen
+  // it.
+  Handle getOrCreateHandle(const State &state) {
+    auto handle_inserted = nodes_.findOrInsert(key(state));
+    if (handle_inserted.second) {
+      handle_inserted.first = node_arena_.allocate(state);
+    }
+    return handle_inserted.first;
+  }
+
+  // Plays config.playouts_per_leaf games from the game's current state to the
+  // end with simulation_policy and returns their average reward, so that every
+  // rollout still counts as one visit. A random policy's moves are played by
+  // the game's own playout loop, unless we want to log each move. Leaves the
+  // game wherever the playouts stopped.
+  template <class SimulationPolicy>
+  static Reward playOut(GameT *game, SimulationPolicy *simulation_policy,
+                        const RolloutConfig &config, DebugLogger &logger) {
+    Reward playout_reward;
+    if (game->isTerminal()) {
+      return playout_reward;
+    }
+    const int simulated_player = game->turn();
+    const int num_playouts = config.playouts_per_leaf;
+    assert(num_playouts >= 1);
+    Rng *playout_rng = randomPlayoutRng<State, Action>(simulation_policy);
+    if (playout_rng != nullptr && !config.verbose) {
+      playout_reward = num_playouts == 1
+                           ? game->randomPlayout(*playout_rng)
+                           : game->randomPlayouts(*playout_rng, num_playouts);
+    } else {
+      const State leaf_state = game->getCurrentState();
+      for (int playout = 0; playout < num_playouts; playout++) {
+        if (playout > 0) {
+          game->setCurrentState(leaf_state);
+        }
+        while (!game->isTerminal()) {
+          const Action action = actWith<State, Action>(simulation_policy, game);
+          const Reward reward = game->simulate(action);
+          if (config.verbose) {
+            logger << "simulation action: " << action.toString()
+                   << " receives reward " << reward.at(simulated_player)
+                   << " resulting in board state: " << std::endl
+                   << game->getCurrentState().render() << std::endl;
+          }
+          playout_reward += reward;
+        }
+      }
+    }
+    playout_reward *= 1.0 / num_playouts;
+    return playout_reward;
+  }
+
+  // Games and policies for the threads of a parallel search. Thread 0 is the
+  // calling thread and uses the caller's game and policy. The others get
+  // clones from thread_clones_.
+  template <class SimulationPolicy> struct ThreadCopies {
+    std::vector<GameT *> games;
+    std::vector<SimulationPolicy *> policies;
+  };
+
+  // Clones of a game and a simulation policy for the threads of parallel
+  // searches, kept between searches so that the policies' streams carry on
+  // where the last search left them instead of replaying the same games.
+  struct ThreadClones {
+    std::vector<std::unique_ptr<Game<State, Action>>> games;
+    std::vector<std::unique_ptr<Policy<State, Action>>> policies;
+    const void *game = nullptr;
+    const void *policy = nullptr;
+  };
+
+  // Sets up num_threads threads to play on game and simulation_policy. Clones
+  // are made the first time they are needed for a game and policy, each
+  // policy clone on a stream of its own, see takeCloneStreams.
+  template <class SimulationPolicy>
+  ThreadCopies<SimulationPolicy>
+  threadCopies(GameT *game, SimulationPolicy *simulation_policy,
+               int num_threads) {
+    assert(num_threads >= 1);
+    if (thread_clones_.game != game ||
+        thread_clones_.policy != simulation_policy) {
+      thread_clones_ = ThreadClones();
+      thread_clones_.game = game;
+      thread_clones_.policy = simulation_policy;
+    }
+    while ((int)thread_clones_.policies.size() < num_threads - 1) {
+      thread_clones_.games.push_back(game->clone());
+      thread_clones_.policies.push_back(
+          simulation_policy->clone(takeCloneStreams(1)));
+      assert(thread_clones_.policies.back() != nullptr &&
+             "simulation policy must support clone for parallel search");
+    }
+    ThreadCopies<SimulationPolicy> copies;
+    copies.games.push_back(game);
+    copies.policies.push_back(simulation_policy);
+    for (int t = 1; t < num_threads; t++) {
+      copies.games.push_back(
+          static_cast<GameT *>(thread_clones_.games[t - 1].get()));
+      copies.policies.push_back(dynamic_cast<SimulationPolicy *>(
+          thread_clones_.policies[t - 1].get()));
+      assert(copies.policies.back() != nullptr);
+    }
+    return copies;
+  }
+
+  // Runs work(t, game, policy) for each thread t of copies, thread 0 being
+  // the calling thread and the others tasks on ThreadPool::global(), and waits
+  // for all of them to finish. The pool may have fewer workers than copies,
+  // so work shouldn't wait on other threads' work to make progress.
+  template <class SimulationPolicy, class Work>
+  static void runOnThreads(const ThreadCopies<SimulationPolicy> &copies,
+                           Work work) {
+    TaskGroup group;
+    for (int t = 1; t < (int)copies.games.size(); t++) {
+      group.run([t, &work, &copies]() {
+        work(t, copies.games[t], copies.policies[t]);
+      });
+    }
+    work(0, copies.games[0], copies.policies[0]);
+    group.wait();
+  }
+
+  // One step down the tree in rolloutShared: the edge taken, the node it led
+  // to, who took it, and the reward for taking it.
+  struct SharedStep {
+    Handle edge;
+    Handle child;
+    int player;
+    Reward reward;
+  };
+
+  // Per-thread state for searchShared.
+  struct SharedScratch {
+    std::vector<SharedStep> path;
+    typename Game<State, Action>::ActionList actions;
+    // Nodes this thread allocated but didn't get to insert, because another
+    // thread inserted the same state first.
+    std::vector<Handle> free_nodes;
+    // A block of edges this thread allocated but didn't get to publish,
+    // because another thread expanded the same node first.
+    Handle spare_edges = kNullHandle;
+    int spare_edges_size = 0;
+  };
+
+  // A rollout for searchShared. Same as rollout, except that the first move
+  // out of a leaf is its first untried edge rather than the simulation
+  // policy's choice, so that edges never have to be reordered under other
+  // threads.
+  template <class SimulationPolicy>
+  void rolloutShared(GameT *game, SimulationPolicy *simulation_policy,
+                     const RolloutConfig &config, SharedScratch &scratch) {
+    std::vector<SharedStep> &path = scratch.path;
+    game->setCurrentState(root_state_);
+    path.clear();
+
+    // Selection and expansion. Visits are counted on the way down, so the
+    // next thread through already sees them.
+    //
+    // If the room made for this round runs out, which only happens if the
+    // estimate in searchShared is off, the tree stops growing and the rollout
+    // simulates from where it got to.
+    Handle cur_handle = root_;
+    atomicFetchAdd(node_arena_[cur_handle].num_rollouts_involved, 1);
+    bool reached_leaf = false;
+    while (!reached_leaf && !game->isTerminal()) {
+      Node &cur_node = node_arena_[cur_handle];
+      if (atomicLoad(cur_node.first_edge, __ATOMIC_ACQUIRE) == kNullHandle) {
+        if (!expandShared(cur_node, game, scratch)) {
+          break;
+        }
+        reached_leaf = true;
+      }
+      const Handle edge = selectEdgeShared(cur_node);
+      const int player = game->turn();
+      atomicFetchAdd(edges_.num_rollouts_involved[edge], 1);
+      atomicFetchAdd(edges_.total_reward[player][edge], -kVirtualLoss);
+      const Reward reward = game->simulate(edges_.action[edge]);
+      Handle child = atomicLoad(edges_.child[edge], __ATOMIC_ACQUIRE);
+      if (child == kNullHandle) {
+        child = tryEdgeShared(cur_node, edge, game->getCurrentState(), scratch);
+      }
+      // With no child node, only the edge keeps the rollout's statistics.
+      if (child != kNullHandle) {
+        atomicFetchAdd(node_arena_[child].num_rollouts_involved, 1);
+      }
+      path.push_back({edge, child, player, reward});
+      if (child == kNullHandle) {
+        break;
+      }
+      cur_handle = child;
+    }
+
+    // Simulation.
+    Reward reward_from_here_for_rollout;
+    {
+      DebugLogger logger(false);
+      const Reward playout_reward =
+          playOut(game, simulation_policy, config, logger);
+      if (path.empty()) {
+        reward_from_here_for_rollout += playout_reward;
+      } else {
+        path.back().reward += playout_reward;
+      }
+    }
+
+    // Backpropagation, taking back the virtual losses.
+    for (int i = path.size() - 1; i >= 0; i--) {
+      const SharedStep &step = path[i];
+      reward_from_here_for_rollout += step.reward;
+      for (int player = 0; player < kNumPlayers; player++) {
+        const double reward = reward_from_here_for_rollout.at(player);
+        if (step.child != kNullHandle) {
+          atomicFetchAdd(
+              node_arena_[step.child].total_reward_from_here.at(player),
+              reward);
+        }
+        atomicFetchAdd(edges_.total_reward[player][step.edge],
+                       player == step.player ? reward + kVirtualLoss : reward);
+      }
+    }
+    Node &root = node_arena_[root_];
+    for (int player = 0; player < kNumPlayers; player++) {
+      atomicFetchAdd(root.total_reward_from_here.at(player),
+                     reward_from_here_for_rollout.at(player));
+    }
+    game->setCurrentState(root_state_);
+  }
 
-    if (child_num_rollouts == 0) {
-      return std::numeric_limits<double>::max();
+  // selectEdge for searchShared, reading statistics that other threads are
+  // updating.
+  Handle selectEdgeShared(const Node &current_node) const {
+    const Handle first = atomicLoad(current_node.first_edge, __ATOMIC_ACQUIRE);
+    const int num_edges = atomicLoad(current_node.num_edges);
+    const int num_tried = atomicLoad(current_node.num_tried);
+    if (num_tried < num_edges) {
+      return first + num_tried;
     }
+    // Take a snapshot of the statistics to score.
+    const int current_node_turn = current_node.state.getTurn();
+    int32_t visits[kMaxActions];
+    double total_reward[kMaxActions];
+    for (int i = 0; i < num_edges; i++) {
+      visits[i] = atomicLoad(edges_.num_rollouts_involved[first + i]);
+      total_reward[i] =
+          atomicLoad(edges_.total_reward[current_node_turn][first + i]);
+    }
+    const int parent_visits = atomicLoad(current_node.num_rollouts_involved);
+    const int best_idx = selectUcb(visits, total_reward, num_edges,
+                                   log((double)parent_visits), C);
+    assert(best_idx >= 0);
+    return first + best_idx;
+  }
 
-    double expected_reward = child_total_reward / (double)child_num_rollouts;
-    double exploration_term =
-        C * sqrt(log((double)parent_num_rollouts) / (double)child_num_rollouts);
+  // expand for searchShared. Fills in a block of edges, then publishes it by
+  // compare-and-swapping it into the node. If another thread published first,
+  // the block is kept for this thread's next expansion. Returns false, leaving
+  // the node unexpanded, if there was no room for the block.
+  bool expandShared(Node &node, const GameT *game, SharedScratch &scratch) {
+    game->getValidActions(scratch.actions);
+    const int num_edges = scratch.actions.size();
+    Handle block = scratch.spare_edges;
+    if (block == kNullHandle || scratch.spare_edges_size < num_edges) {
+      const Handle fresh = edges_.allocateShared(num_edges);
+      if (fresh == kNullHandle) {
+        return false;
+      }
+      block = fresh;
+      scratch.spare_edges_size = num_edges;
+    }
+    for (int i = 0; i < num_edges; i++) {
+      edges_.set(block + i, scratch.actions[i]);
+    }
+    // Every thread expanding the node stores the same count.
+    atomicStore(node.num_edges, num_edges);
+    Handle expected = kNullHandle;
+    if (atomicCompareExchange(node.first_edge, expected, block,
+                              __ATOMIC_RELEASE)) {
+      scratch.spare_edges = kNullHandle;
+    } else {
+      scratch.spare_edges = block;
+    }
+    return true;
+  }
 
-    return expected_reward + exploration_term;
+  // tryEdge for searchShared, on the node's first untried edge. Finds or
+  // creates the node for child_state, then publishes it by compare-and-
+  // swapping it into the edge. Returns the edge's child, which another thread
+  // may have published first, or kNullHandle, leaving the edge untried, if
+  // there was no room for a new node.
+  Handle tryEdgeShared(Node &parent_node, Handle edge, const State &child_state,
+                       SharedScratch &scratch) {
+    const uint64_t child_key = key(child_state);
+    Handle child;
+    if (!nodes_.findShared(child_key, &child)) {
+      Handle fresh;
+      if (scratch.free_nodes.empty()) {
+        fresh = node_arena_.allocateShared(child_state);
+        if (fresh == kNullHandle) {
+          return kNullHandle;
+        }
+      } else {
+        fresh = scratch.free_nodes.back();
+        scratch.free_nodes.pop_back();
+        node_arena_[fresh] = Node(child_state);
+      }
+      const std::optional<std::pair<Handle, bool>> stored =
+          nodes_.findOrInsertShared(child_key, fresh);
+      if (!stored || !stored->second) {
+        scratch.free_nodes.push_back(fresh);
+      }
+      if (!stored) {
+        return kNullHandle;
+      }
+      child = stored->first;
+    }
+    Handle expected = kNullHandle;
+    if (!atomicCompareExchange(edges_.child[edge], expected, child)) {
+      return expected;
+    }
+    // Only the thread that published the edge's child counts it as tried.
+    atomicFetchAdd(parent_node.num_tried, 1);
+    return child;
   }
 
-  std::map<State, Node> nodes_;
-  Node *root_;
+  // Background search for startPondering.
+  class Ponderer {
+  public:
+    Ponderer(UCT *uct, const GameT *game,
+             const Policy<State, Action> *simulation_policy, int num_threads,
+             size_t max_nodes)
+        : game_(game->clone()),
+          // On a stream of its own, like any other clone made for this tree.
+          // The searches clone this clone in turn, so their threads play on
+          // streams split off from this one, see Rng.
+          policy_(simulation_policy->clone(uct->takeCloneStreams(1))) {
+      assert(policy_ != nullptr &&
+             "simulation policy must support clone for pondering");
+      thread_ = std::thread([this, uct, num_threads, max_nodes]() {
+        SearchBudget batch;
+        batch.max_rollouts = num_threads > 1
+                                 ? kSharedRolloutsPerCheck * num_threads
+                                 : kRolloutsPerClockCheck;
+        batch.max_nodes = max_nodes;
+        GameT *game = static_cast<GameT *>(game_.get());
+        while (!stopping_.load(std::memory_order_relaxed) &&
+               uct->numNodes() < max_nodes) {
+          num_rollouts_ +=
+              uct->search(game, policy_.get(), batch, num_threads)
+                  .num_rollouts;
+        }
+      });
+    }
+
+    ~Ponderer() { stop(); }
+
+    int stop() {
+      stopping_.store(true, std::memory_order_relaxed);
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+      return num_rollouts_;
+    }
+
+  private:
+    std::unique_ptr<Game<State, Action>> game_;
+    std::unique_ptr<Policy<State, Action>> policy_;
+    std::atomic<bool> stopping_{false};
+    // Only read after the thread is joined.
+    int num_rollouts_ = 0;
+    std::thread thread_;
+  };
+
+  // Game and policy clones for the pool tasks that run some of a leaf's
+  // playouts while rollout's thread runs the rest, for
+  // RolloutConfig::num_threads. Task w's policy is cloned on stream
+  // first_stream + w.
+  struct LeafCopies {
+    LeafCopies(const GameT *game,
+               const Policy<State, Action> *simulation_policy, int num_tasks,
+               uint64_t first_stream)
+        : results(num_tasks) {
+      for (int w = 0; w < num_tasks; w++) {
+        games.push_back(game->clone());
+        policies.push_back(simulation_policy->clone(first_stream + w));
+        assert(policies.back() != nullptr &&
+               "simulation policy must support clone for leaf parallelism");
+      }
+    }
+
+    int numTasks() const { return games.size(); }
+
+    std::vector<std::unique_ptr<Game<State, Action>>> games;
+    std::vector<std::unique_ptr<Policy<State, Action>>> policies;
+    std::vector<Reward> results;
+  };
+
+  // playOut, with the playouts split between this thread and
+  // config.num_threads - 1 tasks on the thread pool.
+  template <class SimulationPolicy>
+  Reward playOutOnWorkers(GameT *game, SimulationPolicy *simulation_policy,
+                          const RolloutConfig &config) {
+    if (game->isTerminal()) {
+      return Reward();
+    }
+    const int num_tasks = config.num_threads - 1;
+    if (leaf_copies_ == nullptr || leaf_copies_->numTasks() != num_tasks ||
+        leaf_copies_policy_ != simulation_policy) {
+      leaf_copies_ = std::make_unique<LeafCopies>(
+          game, simulation_policy, num_tasks, takeCloneStreams(num_tasks));
+      leaf_copies_policy_ = simulation_policy;
+    }
+    LeafCopies &copies = *leaf_copies_;
+    const State leaf_state = game->getCurrentState();
+
+    // Split the playouts evenly, this thread taking share 0.
+    TaskGroup group;
+    for (int w = 0; w < num_tasks; w++) {
+      const int share = rolloutsForThread(config.playouts_per_leaf,
+                                          config.num_threads, w + 1);
+      copies.results[w] = Reward();
+      if (share == 0) {
+        continue;
+      }
+      group.run([&copies, &leaf_state, &config, w, share]() {
+        GameT *task_game = static_cast<GameT *>(copies.games[w].get());
+        task_game->setCurrentState(leaf_state);
+        RolloutConfig task_config = config;
+        task_config.playouts_per_leaf = share;
+        DebugLogger logger(false);
+        Reward total = playOut(task_game, copies.policies[w].get(),
+                               task_config, logger);
+        total *= share;
+        copies.results[w] = total;
+      });
+    }
+
+    RolloutConfig own_config = config;
+    own_config.playouts_per_leaf =
+        rolloutsForThread(config.playouts_per_leaf, config.num_threads, 0);
+    DebugLogger logger(false);
+    Reward total = playOut(game, simulation_policy, own_config, logger);
+    total *= own_config.playouts_per_leaf;
+
+    group.wait();
+    for (const Reward &result : copies.results) {
+      total += result;
+    }
+    total *= 1.0 / config.playouts_per_leaf;
+    return total;
+  }
+
+  // Marks an untried edge of the node at parent as tried, creating (or finding)
+  // the node for child_state, which the edge leads to. The edge is first
+  // swapped into position num_tried, and the returned handle is where it ends
+  // up.
+  Handle tryEdge(Handle parent, Handle edge, const State &child_state) {
+    const Handle child = getOrCreateHandle(child_state);
+    Node &parent_node = node_arena_[parent];
+    assert(edges_.child[edge] == kNullHandle);
+    const Handle first_untried = parent_node.first_edge + parent_node.num_tried;
+    assert(edge >= first_untried);
+    // Untried edges have no statistics yet, so only the actions need to move.
+    std::swap(edges_.action[edge], edges_.action[first_untried]);
+    edges_.child[first_untried] = child;
+    parent_node.num_tried++;
+    return first_untried;
+  }
+
+  // Returns the edge of an expanded node that plays action.
+  Handle findEdge(const Node &node, const Action &action) const {
+    for (int i = 0; i < node.num_edges; i++) {
+      const Action &edge_action = edges_.action[node.first_edge + i];
+      if (!(edge_action < action) && !(action < edge_action)) {
+        return node.first_edge + i;
+      }
+    }
+    assert(false && "action is not valid in this node");
+    return kNullHandle;
+  }
+
+  // Nodes live in an arena and are indexed by state hash in nodes_. Edges
+  // refer to child nodes by handle.
+  Arena<Node> node_arena_;
+  Edges edges_;
+
+  // Scratch buffers reused across rollouts.
+  std::vector<HistoryFrame> rollout_history_;
+  std::vector<Handle> edge_path_;
+  typename Game<State, Action>::ActionList valid_actions_;
+  TranspositionTable<Handle> nodes_;
+  Handle root_;
+  State root_state_;
+
+  // Per-thread state of searchShared. Kept between calls, since search runs
+  // searchShared in batches and the nodes and edges a thread set aside would
+  // otherwise be lost. They belong to the current tree, so this is dropped
+  // whenever the tree is rebuilt.
+  std::vector<SharedScratch> shared_scratch_;
+
+  // Made by the first rollout with RolloutConfig::num_threads > 1, for the
+  // simulation policy it was given.
+  std::unique_ptr<LeafCopies> leaf_copies_;
+  const void *leaf_copies_policy_ = nullptr;
+  // See threadCopies.
+  ThreadClones thread_clones_;
+  // See takeCloneStreams.
+  uint64_t next_clone_stream_ = 1;
+
+  // Set while pondering. Declared last, so that the pondering thread is
+  // stopped before the rest of the tree is destroyed.
+  std::unique_ptr<Ponderer> ponderer_;
+
 };
 
 #endif // MCTS_UCT
@@ -2,35 +2,93 @@
 #define MCTS_UTILS
 
 #include "mcts.h"
+#include "policy.h"
+#include "rng.h"
+#include "thread_pool.h"
+
+#include <algorithm>
 #include <array>
+#include <memory>
+#include <vector>
 
-// Returns win/loss/draw percentage
-std::array<double, 3> evaluateAgainstRandomOpponent(MCTS<State, Action> *mcts,
-                                                    Game<State, Action> *game) {
-  auto opponent_policy = std::make_unique<RandomValidPolicy<State, Action>>();
-
-  const int num_runs = 300;
-  int num_wins = 0;
-  int num_losses = 0;
-  int num_draws = 0;
-
-  for (int i = 0; i < num_runs; i++) {
-    // Infer game type from reward.
-    double final_reward =
-        mcts->evaluate(game, opponent_policy.get()).back().reward;
-    if (final_reward == 1.0) {
-      num_wins++;
-    } else if (final_reward == 0.0) {
-      num_draws++;
-    } else {
-      assert(final_reward == -1.0);
-      num_losses++;
-    }
+// Results of a batch of evaluation games, from the MCTS's point of view.
+struct EvaluationCounts {
+  int wins = 0;
+  int losses = 0;
+  int draws = 0;
+
+  int numGames() const { return wins + losses + draws; }
+
+  EvaluationCounts &operator+=(const EvaluationCounts &other) {
+    wins += other.wins;
+    losses += other.losses;
+    draws += other.draws;
+    return *this;
+  }
+};
+
+// Plays num_games greedy games of mcts against a random opponent, counting
+// wins, losses and draws. The tree is only read, so the games run in parallel
+// on pool, each batch of games on its own clone of game.
+//
+// Batch b draws our moves from stream 2b of seed, and the opponent's from
+// stream 2b + 1, so a seed gives the same counts however many threads the
+// pool has.
+template <class State, class Action, class GameT>
+EvaluationCounts
+playAgainstRandomOpponent(const MCTS<State, Action, GameT> *mcts,
+                          const GameT *game, bool opponent_goes_first,
+                          int num_games, uint64_t seed = Rng::randomSeed(),
+                          ThreadPool &pool = ThreadPool::global()) {
+  // Small enough batches to spread over the pool, big enough that cloning
+  // the game and seeding the streams doesn't matter.
+  const int kGamesPerBatch = 10;
+  const int num_batches = (num_games + kGamesPerBatch - 1) / kGamesPerBatch;
+  std::vector<EvaluationCounts> batch_counts(num_batches);
+  TaskGroup group(pool);
+  for (int b = 0; b < num_batches; b++) {
+    group.run([&, b]() {
+      std::unique_ptr<Game<State, Action>> batch_game = game->clone();
+      RandomValidPolicy<State, Action> opponent_policy(seed, 2 * b + 1);
+      Rng rng(seed, 2 * b);
+      EvaluationCounts &counts = batch_counts[b];
+      const int batch_games =
+          std::min(kGamesPerBatch, num_games - b * kGamesPerBatch);
+      for (int i = 0; i < batch_games; i++) {
+        // Infer game result from the last reward.
+        const double final_reward = mcts->playGame(
+            static_cast<GameT *>(batch_game.get()), &opponent_policy,
+            opponent_goes_first, /*eps=*/0.0, rng);
+        if (final_reward == 1.0) {
+          counts.wins++;
+        } else if (final_reward == 0.0) {
+          counts.draws++;
+        } else {
+          assert(final_reward == -1.0);
+          counts.losses++;
+        }
+      }
+    });
+  }
+  group.wait();
+
+  EvaluationCounts total;
+  for (const EvaluationCounts &counts : batch_counts) {
+    total += counts;
   }
-  return {(double)num_wins / num_runs, (double)num_losses / num_runs,
-          (double)num_draws / num_runs};
+  return total;
 }
 
-namespace plt = matplotlibcpp;
+// Returns win/loss/draw percentage
+template <class State, class Action, class GameT>
+std::array<double, 3>
+evaluateAgainstRandomOpponent(const MCTS<State, Action, GameT> *mcts,
+                              const GameT *game, bool opponent_goes_first,
+                              int num_runs = 300) {
+  const EvaluationCounts counts =
+      playAgainstRandomOpponent(mcts, game, opponent_goes_first, num_runs);
+  return {(double)counts.wins / num_runs, (double)counts.losses / num_runs,
+          (double)counts.draws / num_runs};
+}
 
 #endif // MCTS_UTILS